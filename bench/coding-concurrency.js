@@ -0,0 +1,117 @@
+'use strict';
+
+// Measure how long small compression streams take while the coding threads
+// are busy with large ones, for a few settings of the work quantum.
+//
+// Usage: node bench/coding-concurrency.js
+//
+// Set BENCH_INPUT_MB to change the input size of each bulk stream
+// (default: 8), and BENCH_THREADS to change the number of coding threads
+// (default: 2). There are twice as many bulk streams as threads.
+
+var lzma = require('../');
+
+var inputSize = (parseInt(process.env.BENCH_INPUT_MB) || 8) * 1024 * 1024;
+var threads = parseInt(process.env.BENCH_THREADS) || 2;
+var smallSize = 4096;
+var smallInterval = 5; // ms
+
+var variants = [
+  { name: 'no quantum', quantum: { bytes: 0, ms: 0 } },
+  { name: '10 ms', quantum: { bytes: 0, ms: 10 } },
+  { name: '2 ms', quantum: { bytes: 0, ms: 2 } },
+  { name: '1 MB', quantum: { bytes: 1024 * 1024, ms: 0 } }
+];
+
+// Pseudo-random text, so that the match finder has real work to do.
+function makeInput(size, seed) {
+  var words = ['lorem', 'ipsum', 'dolor', 'sit', 'amet', 'consectetur',
+    'adipiscing', 'elit', 'sed', 'do', 'eiusmod', 'tempor', '\n'];
+  var parts = [];
+  var length = 0;
+
+  while (length < size) {
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    var word = words[seed % words.length] + ' ';
+    parts.push(word);
+    length += word.length;
+  }
+
+  return Buffer.from(parts.join('')).slice(0, size);
+}
+
+function compress(input, options) {
+  return new Promise(function(resolve, reject) {
+    var stream = lzma.createCompressor(options);
+    stream.on('error', reject);
+    stream.on('end', resolve);
+    stream.resume();
+    stream.end(input);
+  });
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function run(bulkInput, smallInput, variant) {
+  lzma.setCodingQuantum(variant.quantum);
+
+  var latencies = [];
+  var bulkDone = false;
+  var start = process.hrtime();
+
+  var bulk = [];
+  for (var i = 0; i < 2 * threads; i++)
+    bulk.push(compress(bulkInput, { preset: 6, priority: 'bulk' }));
+
+  function small() {
+    if (bulkDone)
+      return Promise.resolve();
+
+    var t = process.hrtime();
+    return compress(smallInput, { preset: 1 }).then(function() {
+      var d = process.hrtime(t);
+      latencies.push(d[0] * 1e3 + d[1] / 1e6);
+
+      return new Promise(function(resolve) {
+        setTimeout(resolve, smallInterval);
+      }).then(small);
+    });
+  }
+
+  var smallDone = small();
+
+  return Promise.all(bulk).then(function() {
+    var time = process.hrtime(start);
+    var seconds = time[0] + time[1] / 1e9;
+    bulkDone = true;
+
+    return smallDone.then(function() {
+      latencies.sort(function(a, b) { return a - b; });
+
+      console.log('%s  bulk %s MB/s  small streams: %d, p50 %s ms, p99 %s ms, max %s ms',
+        (variant.name + '            ').substr(0, 12),
+        (2 * threads * bulkInput.length / seconds / 1e6).toFixed(2),
+        latencies.length,
+        percentile(latencies, 0.5).toFixed(2),
+        percentile(latencies, 0.99).toFixed(2),
+        latencies[latencies.length - 1].toFixed(2));
+    });
+  });
+}
+
+lzma.setCodingThreads(threads);
+
+var bulkInput = makeInput(inputSize, 42);
+var smallInput = makeInput(smallSize, 7);
+var p = Promise.resolve();
+
+variants.forEach(function(variant) {
+  p = p.then(function() { return run(bulkInput, smallInput, variant); });
+});
+
+p.catch(function(err) {
+  console.error(err);
+  process.exitCode = 1;
+});
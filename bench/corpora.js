@@ -0,0 +1,86 @@
+'use strict';
+
+// Fixed inputs for the benchmark suite. They are generated deterministically,
+// so that results from different runs and machines can be compared.
+
+var fs = require('fs');
+var path = require('path');
+var lzma = require('../');
+
+// xorshift32, so that the output does not depend on Math.random().
+function prng(seed) {
+  var x = seed | 0 || 1;
+  return function() {
+    x ^= x << 13;
+    x ^= x >>> 17;
+    x ^= x << 5;
+    return x >>> 0;
+  };
+}
+
+// Shuffled lines of Hamlet. Repeating the text verbatim would let the match
+// finder skip most of the work once the dictionary covers it.
+function text(size) {
+  var hamlet = lzma.decompressSync(fs.readFileSync(
+    path.join(__dirname, '../test/hamlet.txt.xz'))).toString();
+  var lines = hamlet.split('\n');
+  var next = prng(42);
+  var chunks = [];
+  var length = 0;
+
+  while (length < size) {
+    var line = Buffer.from(lines[next() % lines.length] + '\n');
+    chunks.push(line);
+    length += line.length;
+  }
+
+  return Buffer.concat(chunks).slice(0, size);
+}
+
+// Incompressible data. This starts with test/random-large, but that file is
+// too small to be repeated without becoming compressible, so the rest is
+// generated.
+function random(size) {
+  var start = fs.readFileSync(path.join(__dirname, '../test/random-large'));
+  var buf = Buffer.alloc(size);
+  var next = prng(7);
+
+  start.copy(buf, 0, 0, Math.min(start.length, size));
+  for (var i = start.length; i + 4 <= size; i += 4)
+    buf.writeUInt32LE(next(), i);
+
+  return buf;
+}
+
+// Synthetic HTTP server logs: highly repetitive structure with varying
+// timestamps, addresses and numbers.
+function logs(size) {
+  var next = prng(1234);
+  var levels = ['INFO', 'INFO', 'INFO', 'INFO', 'DEBUG', 'WARN', 'ERROR'];
+  var methods = ['GET', 'GET', 'GET', 'POST', 'PUT', 'DELETE'];
+  var paths = ['/', '/index.html', '/api/v1/users', '/api/v1/orders',
+    '/static/app.js', '/static/style.css', '/login', '/health'];
+  var statuses = [200, 200, 200, 200, 201, 204, 301, 304, 404, 500];
+  var time = Date.UTC(2021, 0, 1);
+  var lines = [];
+  var length = 0;
+
+  while (length < size) {
+    time += next() % 250;
+    var line = new Date(time).toISOString() + ' ' +
+      levels[next() % levels.length] + ' ' +
+      '10.' + (next() % 256) + '.' + (next() % 256) + '.' + (next() % 256) + ' ' +
+      methods[next() % methods.length] + ' ' +
+      paths[next() % paths.length] + '?id=' + (next() % 100000) + ' ' +
+      statuses[next() % statuses.length] + ' ' +
+      (next() % 65536) + 'B ' + (next() % 2000) / 10 + 'ms\n';
+    lines.push(line);
+    length += line.length;
+  }
+
+  return Buffer.from(lines.join('')).slice(0, size);
+}
+
+exports.text = text;
+exports.random = random;
+exports.logs = logs;
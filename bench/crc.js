@@ -0,0 +1,66 @@
+'use strict';
+
+// Compare CRC32 and CRC64 throughput of the available CRC kernels, with
+// liblzma's table-based implementation as the baseline.
+//
+// Usage: node bench/crc.js [kernel...]
+//
+// Set BENCH_INPUT_MB to change the amount of input (default: 64).
+
+var crypto = require('crypto');
+var lzma = require('../');
+
+var inputSize = (parseInt(process.env.BENCH_INPUT_MB) || 64) * 1024 * 1024;
+var kernels = process.argv.slice(2);
+if (kernels.length === 0)
+  kernels = ['clmul', 'pmull', 'table'];
+
+var input = crypto.randomBytes(inputSize);
+var best = lzma.crcKernel();
+
+var checks = [
+  { name: 'crc32', run: function() { return lzma.crc32(input); } },
+  { name: 'crc64', run: function() {
+    return lzma.createHash(lzma.CHECK_CRC64).update(input).digest('hex');
+  } }
+];
+
+function measure(fn) {
+  // The fastest of a few runs, so that page faults and frequency scaling
+  // during the first run do not count.
+  var fastest = Infinity;
+  for (var i = 0; i < 5; i++) {
+    var start = process.hrtime();
+    fn();
+    var time = process.hrtime(start);
+    fastest = Math.min(fastest, time[0] + time[1] / 1e9);
+  }
+
+  return fastest;
+}
+
+var expected = {};
+
+kernels.forEach(function(kernel) {
+  try {
+    lzma.setCRCKernel(kernel);
+  } catch (e) {
+    console.log('%s  not available', (kernel + '        ').substr(0, 8));
+    return;
+  }
+
+  checks.forEach(function(check) {
+    var result = check.run();
+    if (check.name in expected && expected[check.name] !== result) {
+      console.error('%s: %s result differs from other kernels', kernel, check.name);
+      process.exitCode = 1;
+    }
+    expected[check.name] = result;
+
+    var seconds = measure(check.run);
+    console.log('%s  %s  %s MB/s', (kernel + '        ').substr(0, 8),
+      check.name, (input.length / seconds / 1e6).toFixed(2));
+  });
+});
+
+lzma.setCRCKernel(best);
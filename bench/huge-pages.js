@@ -0,0 +1,78 @@
+'use strict';
+
+// Compare compression throughput with and without transparent huge pages,
+// for each preset given on the command line (default: 6 to 9).
+//
+// Usage: node bench/huge-pages.js [preset...]
+//
+// Set BENCH_INPUT_MB to change the amount of input (default: 32).
+
+var fs = require('fs');
+var path = require('path');
+var lzma = require('../');
+
+var inputSize = (parseInt(process.env.BENCH_INPUT_MB) || 32) * 1024 * 1024;
+var presets = process.argv.slice(2).map(Number);
+if (presets.length === 0)
+  presets = [6, 7, 8, 9];
+
+// Shuffled lines of text compress a lot less than the text repeated
+// verbatim, so that the match finder has real work to do.
+function makeInput() {
+  var hamlet = lzma.decompress(fs.readFileSync(
+    path.join(__dirname, '../test/hamlet.txt.xz')));
+
+  return hamlet.then(function(hamlet) {
+    var lines = hamlet.toString().split('\n');
+    var chunks = [];
+    var length = 0;
+    var seed = 42;
+
+    while (length < inputSize) {
+      seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+      var line = Buffer.from(lines[seed % lines.length] + '\n');
+      chunks.push(line);
+      length += line.length;
+    }
+
+    return Buffer.concat(chunks).slice(0, inputSize);
+  });
+}
+
+var variants = [
+  { name: 'malloc', options: {} },
+  { name: 'hugePages', options: { hugePages: true } },
+  { name: 'hugePages+prefault', options: { hugePages: true, prefault: true } }
+];
+
+function run(input, preset, variant) {
+  var options = Object.assign({ preset: preset }, variant.options);
+  var start = process.hrtime();
+
+  return lzma.compress(input, options).then(function() {
+    var time = process.hrtime(start);
+    var seconds = time[0] + time[1] / 1e9;
+
+    console.log('preset %d  %s  %s MB/s', preset,
+      (variant.name + '                    ').substr(0, 20),
+      (input.length / seconds / 1e6).toFixed(2));
+  });
+}
+
+// Measure fresh allocations rather than memory reused from earlier runs.
+lzma.setBlockCacheLimit(0);
+
+makeInput().then(function(input) {
+  var p = Promise.resolve();
+
+  presets.forEach(function(preset) {
+    variants.forEach(function(variant) {
+      p = p.then(function() { return run(input, preset, variant); });
+    });
+  });
+
+  return p;
+}).catch(function(err) {
+  console.error(err);
+  process.exitCode = 1;
+});
@@ -0,0 +1,312 @@
+'use strict';
+
+// Benchmark suite for compression and decompression throughput (MB/s) and
+// per-chunk latency (p50/p99, the time from writing a chunk of input to a
+// stream until the stream has consumed it), over fixed corpora and a matrix
+// of presets, bufsize, synchronous vs. asynchronous streams, threads for the
+// multi-threaded encoder and concurrently running streams.
+//
+// Usage: node bench/suite.js [options]
+//
+//   --filter <regexp>     Only run cases whose name matches
+//   --runs <n>            Runs per case (default: 3); the median is reported
+//   --json <file>         Write the results as JSON to a file, or `-` for
+//                         stdout (the table then goes to stderr)
+//   --compare <file>      Compare against results from an earlier --json run
+//   --threshold <pct>     Throughput loss that counts as a regression when
+//                         comparing (default: 10); the exit code is 1 if
+//                         there are any
+//
+// Set BENCH_INPUT_MB to change the size of each corpus (default: 4), and
+// BENCH_CHUNK_KB to change the size of the chunks written (default: 64).
+
+var fs = require('fs');
+var os = require('os');
+var lzma = require('../');
+var corpora = require('./corpora');
+
+var inputSize = (parseInt(process.env.BENCH_INPUT_MB) || 4) * 1024 * 1024;
+var chunkSize = (parseInt(process.env.BENCH_CHUNK_KB) || 64) * 1024;
+
+function parseArgs(argv) {
+  var args = { filter: null, runs: 3, json: null, compare: null, threshold: 10 };
+
+  for (var i = 0; i < argv.length; i++) {
+    var value = argv[i + 1];
+    switch (argv[i]) {
+      case '--filter': args.filter = new RegExp(value); i++; break;
+      case '--runs': args.runs = parseInt(value); i++; break;
+      case '--json': args.json = value; i++; break;
+      case '--compare': args.compare = value; i++; break;
+      case '--threshold': args.threshold = parseFloat(value); i++; break;
+      default:
+        throw new Error('Unknown argument: ' + argv[i]);
+    }
+  }
+
+  return args;
+}
+
+// Every case is identified by all of its parameters, so that results stay
+// comparable when cases are added to the matrix.
+function caseName(c) {
+  return [
+    c.op, c.corpus,
+    'preset=' + c.preset,
+    'mode=' + (c.synchronous ? 'sync' : 'async'),
+    'bufsize=' + (c.bufsize || 'default'),
+    'threads=' + (c.threads || 0),
+    'streams=' + c.streams
+  ].join(' ');
+}
+
+function matrix() {
+  var cases = [];
+  var base = { preset: 6, synchronous: false, bufsize: null, threads: 0, streams: 1 };
+
+  function add(op, corpus, overrides) {
+    cases.push(Object.assign({ op: op, corpus: corpus }, base, overrides));
+  }
+
+  ['text', 'random', 'logs'].forEach(function(corpus) {
+    [1, 6, 9].forEach(function(preset) {
+      add('compress', corpus, { preset: preset });
+      add('decompress', corpus, { preset: preset });
+    });
+  });
+
+  ['compress', 'decompress'].forEach(function(op) {
+    add(op, 'text', { synchronous: true });
+
+    [4096, 1024 * 1024].forEach(function(bufsize) {
+      add(op, 'text', { bufsize: bufsize });
+    });
+
+    [4, 16].forEach(function(streams) {
+      add(op, 'logs', { preset: 1, streams: streams });
+    });
+  });
+
+  // With preset 1, the multi-threaded encoder uses 3 MiB blocks, so that
+  // the default input size is enough to keep more than one thread busy.
+  [1, 2, 4].forEach(function(threads) {
+    add('compress', 'logs', { preset: 1, threads: threads });
+  });
+
+  // The defaults show up several times above.
+  var seen = {};
+  return cases.filter(function(c) {
+    c.name = caseName(c);
+    return seen[c.name] ? false : (seen[c.name] = true);
+  });
+}
+
+function percentile(sorted, p) {
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function median(values) {
+  return values.slice().sort(function(a, b) { return a - b; })[values.length >> 1];
+}
+
+function elapsedMs(start) {
+  var time = process.hrtime(start);
+  return time[0] * 1e3 + time[1] / 1e6;
+}
+
+// Writes input chunk by chunk, waiting for each chunk to be consumed before
+// writing the next one, and records how long that took.
+function runStream(c, input, latencies) {
+  return new Promise(function(resolve, reject) {
+    var options = { preset: c.preset, synchronous: c.synchronous };
+    if (c.bufsize)
+      options.bufsize = c.bufsize;
+    if (c.threads)
+      options.threads = c.threads;
+
+    var stream = c.op === 'compress' ?
+      lzma.createCompressor(options) : lzma.createDecompressor(options);
+    var outputSize = 0;
+
+    stream.on('data', function(chunk) { outputSize += chunk.length; });
+    stream.on('error', reject);
+    stream.on('end', function() { resolve(outputSize); });
+
+    function write(offset) {
+      if (offset >= input.length)
+        return stream.end();
+
+      var start = process.hrtime();
+      stream.write(input.slice(offset, offset + chunkSize), function(err) {
+        if (err)
+          return reject(err);
+
+        latencies.push(elapsedMs(start));
+        write(offset + chunkSize);
+      });
+    }
+
+    write(0);
+  });
+}
+
+function runOnce(c, input, expectedSize) {
+  var latencies = [];
+  var streams = [];
+  var start = process.hrtime();
+
+  for (var i = 0; i < c.streams; i++)
+    streams.push(runStream(c, input, latencies));
+
+  return Promise.all(streams).then(function(outputSizes) {
+    var seconds = elapsedMs(start) / 1e3;
+
+    outputSizes.forEach(function(size) {
+      if (expectedSize !== null && size !== expectedSize)
+        throw new Error(c.name + ': got ' + size + ' bytes, expected ' + expectedSize);
+    });
+
+    return { seconds: seconds, latencies: latencies };
+  });
+}
+
+function runCase(c, inputs, runs) {
+  var original = inputs[c.corpus];
+  var input = original;
+  var expectedSize = null;
+
+  // Decompression is measured in terms of decompressed bytes.
+  if (c.op === 'decompress') {
+    var key = c.corpus + ' ' + c.preset;
+    input = inputs.compressed[key] ||
+      (inputs.compressed[key] = lzma.compressSync(original, { preset: c.preset }));
+    expectedSize = original.length;
+  }
+
+  var rates = [];
+  var latencies = [];
+  var p = Promise.resolve();
+
+  for (var i = 0; i < runs; i++) {
+    p = p.then(function() {
+      return runOnce(c, input, expectedSize);
+    }).then(function(result) {
+      rates.push(c.streams * original.length / result.seconds / 1e6);
+      latencies.push.apply(latencies, result.latencies);
+    });
+  }
+
+  return p.then(function() {
+    latencies.sort(function(a, b) { return a - b; });
+
+    return {
+      mbps: +median(rates).toFixed(2),
+      p50: +percentile(latencies, 0.5).toFixed(3),
+      p99: +percentile(latencies, 0.99).toFixed(3),
+      chunks: latencies.length,
+      runs: runs
+    };
+  });
+}
+
+function pad(s, n) {
+  s = String(s);
+  while (s.length < n)
+    s += ' ';
+  return s;
+}
+
+function percentChange(before, after) {
+  return (after - before) / before * 100;
+}
+
+function formatChange(before, after) {
+  var change = percentChange(before, after);
+  return (change >= 0 ? '+' : '') + change.toFixed(1) + '%';
+}
+
+function compare(results, baseline, threshold, log) {
+  var regressions = 0;
+
+  log('\nCompared to %s (%s):', baseline.date, baseline.version);
+
+  Object.keys(results).forEach(function(name) {
+    var before = baseline.results[name];
+    var after = results[name];
+    if (!before)
+      return;
+
+    var regressed = percentChange(before.mbps, after.mbps) < -threshold;
+    if (regressed)
+      regressions++;
+
+    log('%s %s MB/s %s  p99 %s ms %s%s', pad(name, 76),
+      pad(after.mbps, 8), pad(formatChange(before.mbps, after.mbps), 7),
+      pad(after.p99, 8), pad(formatChange(before.p99, after.p99), 7),
+      regressed ? '  REGRESSION' : '');
+  });
+
+  log('%d regression(s) beyond %d%%', regressions, threshold);
+  return regressions;
+}
+
+function main() {
+  var args = parseArgs(process.argv.slice(2));
+  // Keep stdout clean for the JSON output if it goes there.
+  var log = args.json === '-' ? console.error : console.log;
+
+  var inputs = {
+    text: corpora.text(inputSize),
+    random: corpora.random(inputSize),
+    logs: corpora.logs(inputSize),
+    compressed: {}
+  };
+
+  var cases = matrix().filter(function(c) {
+    return !args.filter || args.filter.test(c.name);
+  });
+
+  var results = {};
+  var p = Promise.resolve();
+
+  cases.forEach(function(c) {
+    p = p.then(function() {
+      return runCase(c, inputs, args.runs);
+    }).then(function(result) {
+      results[c.name] = result;
+      log('%s %s MB/s  p50 %s ms  p99 %s ms', pad(c.name, 76),
+        pad(result.mbps, 8), pad(result.p50, 8), result.p99);
+    });
+  });
+
+  return p.then(function() {
+    var report = {
+      version: lzma.version,
+      liblzma: lzma.versionString(),
+      node: process.version,
+      platform: process.platform,
+      arch: process.arch,
+      cpus: os.cpus().length,
+      date: new Date().toISOString(),
+      inputBytes: inputSize,
+      chunkBytes: chunkSize,
+      results: results
+    };
+
+    if (args.json === '-')
+      console.log(JSON.stringify(report, null, 2));
+    else if (args.json)
+      fs.writeFileSync(args.json, JSON.stringify(report, null, 2) + '\n');
+
+    if (args.compare) {
+      var baseline = JSON.parse(fs.readFileSync(args.compare, 'utf8'));
+      if (compare(results, baseline, args.threshold, log) > 0)
+        process.exitCode = 1;
+    }
+  });
+}
+
+main().catch(function(err) {
+  console.error(err);
+  process.exitCode = 1;
+});
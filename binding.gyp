@@ -12,7 +12,17 @@
         "src/lzma-stream.cpp",
         "src/module.cpp",
         "src/mt-options.cpp",
-        "src/index-parser.cpp"
+        "src/index-parser.cpp",
+        "src/index-sidecar.cpp",
+        "src/output-buffer-pool.cpp",
+        "src/coder-pool.cpp",
+        "src/coding-thread-pool.cpp",
+        "src/block-cache.cpp",
+        "src/buffer-coding.cpp",
+        "src/block-decoder.cpp",
+        "src/hasher.cpp",
+        "src/crc.cpp",
+        "src/tracer.cpp"
       ],
       'include_dirs': ["<!@(node -p \"require('node-addon-api').include\")"],
       'dependencies': ["<!(node -p \"require('node-addon-api').gyp\")", "liblzma"],
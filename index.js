@@ -4,6 +4,7 @@
 var stream = require('readable-stream');
 var assert = require('assert');
 var fs = require('fs');
+var os = require('os');
 var util = require('util');
 
 var native = require('node-gyp-build')(__dirname);
@@ -54,17 +55,32 @@ class JSLzmaStream extends stream.Transform {
     // always clean up in case of error
     this.once('error-cleanup', this.cleanup);
 
-    this.nativeStream.bufferHandler = (buf, processedChunks, err, totalIn, totalOut) => {
+    // Called once per coding step with all output that has been produced,
+    // whether the underlying stream has ended or failed, and the number of
+    // input chunks that have been fully consumed.
+    this.nativeStream.bufferHandler = (buffers, ended, err, processedChunks, totalIn, totalOut) => {
       if (totalIn !== null) {
         this.totalIn_  = totalIn;
         this.totalOut_ = totalOut;
       }
 
       setImmediate(() => {
+        for (var i = 0; i < buffers.length; i++)
+          this.push(buffers[i]);
+
         if (err) {
           this.push(null);
           this.emit('error-cleanup', err);
-          this.emit('error', err);
+
+          // None of the pending chunks will be consumed anymore, so they
+          // fail with the error, which makes the stream emit it as well.
+          var failedCallbacks = this.chunkCallbacks.splice(0);
+          if (failedCallbacks.length === 0)
+            this.emit('error', err);
+
+          while (failedCallbacks.length > 0)
+            failedCallbacks.shift().call(this, err);
+
           return;
         }
 
@@ -75,30 +91,23 @@ class JSLzmaStream extends stream.Transform {
           });
         }
 
-        if (typeof processedChunks === 'number') {
+        if (ended) {
+          // Decoders handle concatenated streams natively and only end
+          // once all input has been seen. Other coders may end early,
+          // in which case _flush() has nothing left to do.
+          if (!this._writingLastChunk)
+            this._isFinished = true;
+
+          this.push(null);
+        }
+
+        if (processedChunks > 0) {
           assert.ok(processedChunks <= this.chunkCallbacks.length);
 
           var chunkCallbacks = this.chunkCallbacks.splice(0, processedChunks);
 
           while (chunkCallbacks.length > 0)
             chunkCallbacks.shift().call(this);
-        } else if (buf === null) {
-          if (this._writingLastChunk) {
-            this.push(null);
-          } else {
-            // There may be additional members in the file.
-            // Reset and set _isFinished to tell `_flush()` that nothing
-            // needs to be done.
-            this._isFinished = true;
-
-            if (this.nativeStream && this.nativeStream._restart) {
-              this.nativeStream._restart();
-            } else {
-              this.push(null);
-            }
-          }
-        } else {
-          this.push(buf);
         }
       });
     };
@@ -106,6 +115,11 @@ class JSLzmaStream extends stream.Transform {
     if (typeof options.bufsize !== 'undefined') {
       this.bufsize = options.bufsize;
     }
+
+    if (options.adaptiveBufsize) {
+      this.setAdaptiveBufsize(options.minBufsize || 4096,
+                              options.maxBufsize || 1024 * 1024);
+    }
   }
 
   get bufsize() {
@@ -131,37 +145,44 @@ class JSLzmaStream extends stream.Transform {
   cleanup() {
     if (this.nativeStream) {
       this.nativeStream.resetUnderlying();
+      this.finalStats_ = this.nativeStream.getStats();
     }
 
     this.nativeStream = null;
+    memoryGovernor.release(this);
   }
 
-  _transform(chunk, encoding, callback) {
-    if (!this.nativeStream) return;
-    // Split the chunk at 'YZ'. This is used to have a clean boundary at the
-    // end of each `.xz` file stream.
-    var possibleEndIndex = bufferIndexOfYZ(chunk);
-    if (possibleEndIndex !== -1) {
-      possibleEndIndex += 2;
-      if (possibleEndIndex !== chunk.length) {
-        this._transform(chunk.slice(0, possibleEndIndex), encoding, () => {
-          this._transform(chunk.slice(possibleEndIndex), encoding, callback);
-        });
+  // Called by the memory governor once there is enough memory available
+  // for the coder to be initialized.
+  _admit() {
+    var init = this._pendingInit;
+    this._pendingInit = null;
 
-        return;
-      }
+    try {
+      init();
+    } catch (e) {
+      this.emit('error-cleanup', e);
+      this.emit('error', e);
+      return;
+    }
+
+    if (this._deferredTransform) {
+      var deferred = this._deferredTransform;
+      this._deferredTransform = null;
+      deferred();
     }
+  }
 
-    if (this._isFinished && chunk) {
-      chunk = skipLeadingZeroes(chunk);
+  _transform(chunk, encoding, callback) {
+    if (!this.nativeStream) return;
 
-      if (chunk.length > 0) {
-        // Real data from a second stream member in the file!
-        this._isFinished = false;
-      }
+    if (this._pendingInit) {
+      this._deferredTransform = () => this._transform(chunk, encoding, callback);
+      return;
     }
 
-    if (chunk && chunk.length === 0) {
+    // The coder has already ended, so there is nothing to pass this on to.
+    if (this._isFinished || (chunk && chunk.length === 0)) {
       return callback();
     }
 
@@ -175,9 +196,17 @@ class JSLzmaStream extends stream.Transform {
     }
   }
 
+  // Corked writes are passed to the native stream as an array of Buffers,
+  // which it reads one after another without copying them together first.
+  // The callback is called once all of them have been consumed.
   _writev(chunks, callback) {
     chunks = chunks.map(chunk => chunk.chunk);
-    this._write(Buffer.concat(chunks), null, callback);
+    this._write(chunks, null, callback);
+  }
+
+  _destroy(err, callback) {
+    this.cleanup();
+    callback(err);
   }
 
   _flush(callback) {
@@ -205,6 +234,11 @@ Object.getOwnPropertyNames(native.Stream.prototype).forEach(function(key) {
   };
 });
 
+// The counters remain available once the stream has finished.
+JSLzmaStream.prototype.getStats = function() {
+  return this.nativeStream ? this.nativeStream.getStats() : this.finalStats_;
+};
+
 Stream.prototype.rawEncoder = function(options) {
   return this.rawEncoder_(options.filters || []);
 };
@@ -244,22 +278,10 @@ Stream.prototype.streamEncoder = function(options) {
 };
 
 Stream.prototype.streamDecoder = function(options) {
-  this._initOptions = options;
-  this._restart = function() {
-    this.resetUnderlying();
-    this.streamDecoder(this._initOptions);
-  };
-
   return this.streamDecoder_(options.memlimit || null, options.flags || 0);
 };
 
 Stream.prototype.autoDecoder = function(options) {
-  this._initOptions = options;
-  this._restart = function() {
-    this.resetUnderlying();
-    this.autoDecoder(this._initOptions);
-  };
-
   return this.autoDecoder_(options.memlimit || null, options.flags || 0);
 };
 
@@ -282,12 +304,191 @@ exports.createStream = function(coder, options) {
   options = options || {};
 
   var stream = new Stream();
-  stream[coder](options);
 
-  if (options.memlimit)
-    stream.memlimitSet(options.memlimit);
+  // Multi-threaded encoders cannot be shared between streams. Coders keep
+  // their memory, so those that use huge pages are kept apart.
+  if (options.coderPool && (typeof options.threads === 'undefined' || options.threads === null)) {
+    stream.setCoderPoolKey(coder + ':' + JSON.stringify([
+      options.preset, options.check, options.filters,
+      options.hugePages ? options.hugePageThreshold || 2 * 1024 * 1024 : 0
+    ]));
+  }
+
+  if (options.priority)
+    stream.setPriority(options.priority);
+
+  // Needs to happen before the coder is initialized, which is when most
+  // of its memory is allocated.
+  if (options.hugePages)
+    stream.setHugePages(options.hugePageThreshold || 2 * 1024 * 1024, !!options.prefault);
+
+  var memusage = estimateMemusage(coder, options);
+
+  // Streams that have to wait behind others anyway keep their preset.
+  if (options.allowPresetDowngrade && memoryGovernor.queue.length === 0 &&
+      !memoryGovernor.hasRoom(memusage) &&
+      ['easyEncoder', 'aloneEncoder'].indexOf(coder) !== -1) {
+    var preset = options.preset || exports.PRESET_DEFAULT;
+    var level = preset & exports.PRESET_LEVEL_MASK;
+
+    // Level 0 cannot be requested through `options.preset`.
+    while (level > 1) {
+      level--;
+      var downgraded = Object.assign({}, options, {
+        preset: level | (preset & exports.PRESET_EXTREME)
+      });
+      var downgradedMemusage = estimateMemusage(coder, downgraded);
+
+      if (memoryGovernor.hasRoom(downgradedMemusage)) {
+        options = downgraded;
+        memusage = downgradedMemusage;
+        break;
+      }
+    }
+  }
+
+  var init = function() {
+    stream[coder](options);
+
+    if (options.memlimit)
+      stream.memlimitSet(options.memlimit);
+  };
+
+  if (memoryGovernor.fits(memusage)) {
+    init();
+    var jsStream = stream.getStream(options);
+    memoryGovernor.reserve(jsStream, memusage);
+    return jsStream;
+  }
+
+  var queued = stream.getStream(options);
+  queued._pendingInit = init;
+  memoryGovernor.enqueue(queued, memusage);
+  return queued;
+};
+
+/* process-wide memory budget for coders */
+var memoryGovernor = {
+  budget: Infinity,
+  usage: 0,
+  streams: 0,
+  queue: [],
+
+  // A single stream is always admitted, so that streams that are larger
+  // than the budget do not wait forever.
+  hasRoom: function(memusage) {
+    return this.streams === 0 || this.usage + memusage <= this.budget;
+  },
+
+  // Streams that are queued go first.
+  fits: function(memusage) {
+    return this.queue.length === 0 && this.hasRoom(memusage);
+  },
+
+  reserve: function(stream, memusage) {
+    stream._memoryReservation = memusage;
+    this.usage += memusage;
+    this.streams++;
+  },
+
+  enqueue: function(stream, memusage) {
+    this.queue.push({ stream: stream, memusage: memusage });
+  },
+
+  release: function(stream) {
+    if (typeof stream._memoryReservation === 'number') {
+      this.usage -= stream._memoryReservation;
+      this.streams--;
+      stream._memoryReservation = null;
+    } else {
+      this.queue = this.queue.filter(function(entry) {
+        return entry.stream !== stream;
+      });
+    }
+
+    this.admitQueued();
+  },
+
+  admitQueued: function() {
+    while (this.queue.length > 0) {
+      var next = this.queue[0];
+      if (!this.hasRoom(next.memusage))
+        break;
+
+      this.queue.shift();
+      this.reserve(next.stream, next.memusage);
+      next.stream._admit();
+    }
+  }
+};
+
+function estimateMemusage(coder, options) {
+  var check = options.check || exports.CHECK_CRC32;
+  var threaded = typeof options.threads !== 'undefined' && options.threads !== null;
+  var memusage = null;
+
+  switch (coder) {
+    case 'easyEncoder':
+    case 'aloneEncoder':
+      if (threaded && coder === 'easyEncoder') {
+        memusage = exports.mtEncoderMemusage_(Object.assign({
+          preset: options.preset || exports.PRESET_DEFAULT,
+          filters: null,
+          check: check
+        }, options));
+      } else {
+        memusage = exports.easyEncoderMemusage(options.preset || exports.PRESET_DEFAULT);
+      }
+      break;
+    case 'streamEncoder':
+      if (threaded) {
+        memusage = exports.mtEncoderMemusage_(Object.assign({
+          preset: null,
+          filters: options.filters || [],
+          check: check
+        }, options));
+      } else if (options.filters && options.filters.length > 0) {
+        memusage = exports.rawEncoderMemusage(options.filters);
+      }
+      break;
+    case 'rawEncoder':
+      memusage = exports.rawEncoderMemusage(options.filters || []);
+      break;
+    case 'rawDecoder':
+      memusage = exports.rawDecoderMemusage(options.filters || []);
+      break;
+    default:
+      // Decoders only know how much memory they need once they have seen
+      // the input, which is limited by `memlimit` if set.
+      if (typeof options.memlimit === 'number' && isFinite(options.memlimit))
+        memusage = options.memlimit;
+      else
+        memusage = exports.easyDecoderMemusage(exports.PRESET_DEFAULT);
+  }
+
+  return memusage || exports.easyEncoderMemusage(exports.PRESET_DEFAULT);
+}
+
+exports.setMemoryBudget = function(bytes) {
+  if (bytes === null || typeof bytes === 'undefined')
+    bytes = Infinity;
+
+  if (typeof bytes !== 'number' || !(bytes >= 0))
+    throw new TypeError('setMemoryBudget() needs a non-negative numerical argument');
 
-  return stream.getStream(options);
+  var previous = memoryGovernor.budget;
+  memoryGovernor.budget = bytes;
+  memoryGovernor.admitQueued();
+  return previous;
+};
+
+exports.memoryGovernorStats = function() {
+  return {
+    budget: memoryGovernor.budget,
+    usage: memoryGovernor.usage,
+    streams: memoryGovernor.streams,
+    queueDepth: memoryGovernor.queue.length
+  };
 };
 
 exports.createCompressor = function(options) {
@@ -310,6 +511,65 @@ exports.crc32 = function(input, encoding, presetCRC32) {
   return exports.crc32_(input, presetCRC32 || 0);
 };
 
+/* incremental checksums */
+class Hash {
+  constructor(check) {
+    this.hasher = new native.Hasher(check);
+  }
+
+  update(data, encoding) {
+    if (typeof data === 'string')
+      data = Buffer.from(data, encoding);
+
+    this.hasher.update(data);
+    return this;
+  }
+
+  // Hash a Buffer on the thread pool. The Buffer must not be modified and
+  // the hash not be used otherwise until the callback has been called.
+  updateAsync(data, callback) {
+    var promise = new Promise((resolve, reject) => {
+      this.hasher.updateAsync(data, err => err ? reject(err) : resolve(this));
+    });
+
+    return promiseOrCallback(promise, callback);
+  }
+
+  // Hash the contents of a file descriptor on the thread pool, from
+  // options.start to the end of the file or up to options.length bytes.
+  // Reports the number of bytes that were read.
+  updateFD(fd, options, callback) {
+    if (typeof options === 'function') {
+      callback = options;
+      options = {};
+    }
+
+    options = options || {};
+    var start = options.start || 0;
+    var length = typeof options.length === 'number' ? options.length : null;
+
+    if (typeof start !== 'number' || start < 0 || (length !== null && length < 0))
+      throw new RangeError('start and length need to be non-negative numbers');
+
+    var promise = new Promise((resolve, reject) => {
+      this.hasher.updateFD(fd, start, length, (err, bytes) => err ? reject(err) : resolve(bytes));
+    });
+
+    return promiseOrCallback(promise, callback);
+  }
+
+  // CRCs are little-endian, as in .xz files. More data can be added after
+  // a digest has been taken.
+  digest(encoding) {
+    var digest = this.hasher.digest();
+    return encoding ? digest.toString(encoding) : digest;
+  }
+}
+
+exports.createHash = function(check) {
+  return new Hash(check);
+};
+
 /* compatibility: node-xz (https://github.com/robey/node-xz) */
 exports.Compressor = function(preset, options) {
   options = Object.assign({}, options);
@@ -389,11 +649,17 @@ exports.LZMA = function() {
       if (parseInt(mode) === parseInt(mode) && mode >= 1 && mode <= 9)
         opt.preset = parseInt(mode);
 
+      if (canUseBufferCoding({}))
+        return singleBufferCoding('aloneEncoder', string, opt, on_finish, on_progress);
+
       var stream = createStream('aloneEncoder', opt);
 
       return singleStringCoding(stream, string, on_finish, on_progress);
     },
     decompress: function(byte_array, on_finish, on_progress) {
+      if (canUseBufferCoding({}))
+        return singleBufferCoding('autoDecoder', byte_array, {}, on_finish, on_progress);
+
       var stream = createStream('autoDecoder');
 
       return singleStringCoding(stream, byte_array, on_finish, on_progress);
@@ -403,22 +669,163 @@ exports.LZMA = function() {
   };
 };
 
+/* one-shot coding of complete Buffers */
+function bufferCodingOptions(options) {
+  if (parseInt(options) === parseInt(options))
+    return {preset: parseInt(options)};
+
+  return options || {};
+}
+
+// Options that the native one-shot coders understand; everything else
+// needs a full stream.
+var bufferCodingOptionNames = ['preset', 'check', 'memlimit', 'oneShot'];
+
+function canUseBufferCoding(options) {
+  if (memoryGovernor.budget !== Infinity)
+    return false;
+
+  if (options.memlimit !== null && typeof options.memlimit !== 'undefined' &&
+      typeof options.memlimit !== 'number')
+    return false;
+
+  return Object.keys(options).every(function(name) {
+    return bufferCodingOptionNames.indexOf(name) !== -1 ||
+      options[name] === null || typeof options[name] === 'undefined';
+  });
+}
+
+function startBufferCoding(coder, input, options, callback) {
+  if (!Buffer.isBuffer(input))
+    input = Buffer.from(input);
+
+  switch (coder) {
+    case 'easyEncoder':
+      return exports.compressBuffer_(input,
+        options.preset || exports.PRESET_DEFAULT,
+        options.check || exports.CHECK_CRC32,
+        callback);
+    case 'aloneEncoder':
+      return exports.aloneCompressBuffer_(input, options, callback);
+    case 'autoDecoder':
+      return exports.decompressBuffer_(input, options.memlimit || null, callback);
+  }
+}
+
+function singleBufferCoding(coder, input, options, on_finish, on_progress) {
+  on_progress = on_progress || function() {};
+  on_finish = on_finish || function() {};
+
+  var deferred = {};
+  deferred.promise = new Promise(function(resolve, reject) {
+    deferred.resolve = resolve;
+    deferred.reject = reject;
+  });
+
+  deferred.promise.catch(noop);
+
+  on_progress(0.0);
+
+  startBufferCoding(coder, input, options, function(err, result) {
+    if (err) {
+      on_finish(null, err);
+      deferred.reject(err);
+    } else {
+      on_progress(1.0);
+      on_finish(result);
+      deferred.resolve(result);
+    }
+  });
+
+  return deferred.promise;
+}
+
+exports.compressSync = function(input, options) {
+  return startBufferCoding('easyEncoder', input, bufferCodingOptions(options));
+};
+
+exports.decompressSync = function(input, options) {
+  return startBufferCoding('autoDecoder', input, bufferCodingOptions(options));
+};
+
 exports.compress = function(string, opt, on_finish) {
   if (typeof opt === 'function') {
     on_finish = opt;
     opt = {};
   }
 
+  // The one-shot encoder records the block sizes in the block headers, so
+  // its output differs from that of streams and it needs to be asked for.
+  var options = bufferCodingOptions(opt);
+  if (options.oneShot && canUseBufferCoding(options))
+    return singleBufferCoding('easyEncoder', string, options, on_finish);
+
   var stream = createStream('easyEncoder', opt);
   return singleStringCoding(stream, string, on_finish);
 };
 
+// Decode a complete .xz Buffer with the blocks of all of its streams spread
+// across threads. Input whose index cannot be parsed, e.g. .lzma files or
+// files with trailing garbage, goes through a regular decoder instead.
+function parallelBufferDecoding(input, options, on_finish) {
+  on_finish = on_finish || function() {};
+
+  var deferred = {};
+  deferred.promise = new Promise(function(resolve, reject) {
+    deferred.resolve = resolve;
+    deferred.reject = reject;
+  });
+
+  deferred.promise.catch(noop);
+
+  var finish = function(err, result) {
+    if (err) {
+      on_finish(null, err);
+      deferred.reject(err);
+    } else {
+      on_finish(result);
+      deferred.resolve(result);
+    }
+  };
+
+  openReader(input, { memlimit: options.memlimit }, function(err, reader) {
+    if (err || reader.blocks <= 1) {
+      singleStringCoding(createStream('autoDecoder', options), input).then(function(result) {
+        finish(null, result);
+      }, finish);
+      return;
+    }
+
+    var buffers = [];
+
+    reader.createReadStream({
+      threads: options.threads,
+      maxInFlightBytes: options.maxInFlightBytes
+    }).on('data', function(chunk) {
+      buffers.push(chunk);
+    }).on('end', function() {
+      finish(null, Buffer.concat(buffers));
+    }).on('error', finish);
+  });
+
+  return deferred.promise;
+}
+
 exports.decompress = function(string, opt, on_finish) {
   if (typeof opt === 'function') {
     on_finish = opt;
     opt = {};
   }
 
+  var options = bufferCodingOptions(opt);
+  if (canUseBufferCoding(options))
+    return singleBufferCoding('autoDecoder', string, options, on_finish);
+
+  if (typeof options.threads !== 'undefined' && options.threads !== null &&
+      Buffer.isBuffer(string) && exports.isXZ(string)) {
+    return parallelBufferDecoding(string, options, on_finish);
+  }
+
   var stream = createStream('autoDecoder', opt);
   return singleStringCoding(stream, string, on_finish);
 };
@@ -438,7 +845,9 @@ exports.isXZ = function(buf) {
          buf[5] === 0x00;
 };
 
-exports.parseFileIndex = function(options, callback) {
+// Like parseFileIndex(), but also passes the IndexParser that holds the
+// parsed index to the callback.
+function parseIndexes(options, callback) {
   if (typeof options !== 'object') {
     throw new TypeError('parseFileIndex needs an options object');
   }
@@ -491,7 +900,7 @@ exports.parseFileIndex = function(options, callback) {
       }
 
       if (info !== true) {
-        return callback(null, cleanupIndexInfo(info));
+        return callback(null, cleanupIndexInfo(info, p, options), p);
       }
     });
 
@@ -513,43 +922,346 @@ exports.parseFileIndex = function(options, callback) {
   }
 
   if (info !== true) {
-    info = cleanupIndexInfo(info);
+    info = cleanupIndexInfo(info, p, options);
     if (typeof callback !== 'undefined' && info !== true) {
-      callback(null, info);
+      callback(null, info, p);
     }
 
     return info;
   }
+}
+
+exports.parseFileIndex = function(options, callback) {
+  return parseIndexes(options, callback && function(err, info) {
+    callback(err, info);
+  });
 };
 
-exports.parseFileIndexFD = function(fd, callback) {
-  return fs.fstat(fd, function(err, stats) {
+// Like parseIndexes(), but reads from a file descriptor and parses on the
+// thread pool without going through JS for each read.
+function parseIndexesFD(fd, options, callback) {
+  var p = new native.IndexParser();
+
+  p.parseFD(fd, options.memlimit || 0, options.sidecar || null, function(err, info) {
     if (err) {
       return callback(err, null);
     }
 
-    exports.parseFileIndex({
-      fileSize: stats.size,
+    callback(null, cleanupIndexInfo(info, p, options), p);
+  });
+}
+
+exports.parseFileIndexFD = function(fd, options, callback) {
+  if (typeof options === 'function') {
+    callback = options;
+    options = {};
+  }
+
+  parseIndexesFD(fd, options || {}, function(err, info) {
+    callback(err, info);
+  });
+};
+
+/* random access to and block-parallel decoding of .xz files */
+function openReader(source, options, callback) {
+  var memlimit = options.memlimit || null;
+  var nativeSource = null;
+
+  var parsed = function(err, info, parser) {
+    if (err) {
+      return callback(err, null);
+    }
+
+    var reader;
+    try {
+      reader = new XZReader(new native.BlockDecoder(parser, nativeSource, memlimit), source);
+    } catch (e) {
+      return callback(e, null);
+    }
+
+    callback(null, reader);
+  };
+
+  if (typeof source === 'number') {
+    nativeSource = source;
+
+    parseIndexesFD(source, { memlimit: memlimit, sidecar: options.sidecar }, parsed);
+  } else if (Buffer.isBuffer(source)) {
+    nativeSource = source;
+
+    parseIndexes({
+      fileSize: source.length,
+      memlimit: memlimit,
       read: function(count, offset, cb) {
-        var buffer = Buffer.allocUnsafe(count);
+        cb(null, source.slice(offset, offset + count));
+      }
+    }, parsed);
+  } else if (source && typeof source.read === 'function' &&
+             typeof source.fileSize === 'number') {
+    parseIndexes({
+      fileSize: source.fileSize,
+      memlimit: memlimit,
+      read: source.read
+    }, parsed);
+  } else {
+    throw new TypeError('Expected a file descriptor, Buffer or read callback as input');
+  }
+}
+
+class XZReader {
+  constructor(decoder, source) {
+    this._decoder = decoder;
+    this._source = source;
+
+    this.blocks = decoder.blockCount();
+    this.size = 0;
+
+    if (this.blocks > 0) {
+      var last = decoder.block(this.blocks - 1);
+      this.size = last.uncompressedOffset + last.uncompressedSize;
+    }
+  }
 
-        fs.read(fd, buffer, 0, count, offset, function(err, bytesRead, buffer) {
-          if (err) {
-            return cb(err, null);
-          }
+  _decodeBlock(index, callback) {
+    if (typeof this._source === 'number' || Buffer.isBuffer(this._source))
+      return this._decoder.decode(index, callback);
 
-          if (bytesRead !== count) {
-            return cb(new Error('Truncated file!'), null);
-          }
+    var block = this._decoder.block(index);
 
-          cb(null, buffer);
-        });
+    this._source.read(block.compressedSize, block.compressedOffset, (err, buffer) => {
+      if (Buffer.isBuffer(err)) {
+        buffer = err;
+        err = null;
       }
-    }, callback);
+
+      if (err)
+        return callback(err, null);
+
+      this._decoder.decode(index, callback, buffer);
+    });
+  }
+
+  read(offset, length, callback) {
+    var promise = new Promise((resolve, reject) => {
+      var buffers = [];
+
+      this.createReadStream({
+        start: offset,
+        end: offset + length - 1
+      }).on('data', function(chunk) {
+        buffers.push(chunk);
+      }).on('end', function() {
+        resolve(Buffer.concat(buffers));
+      }).on('error', reject);
+    });
+
+    return promiseOrCallback(promise, callback);
+  }
+
+  createReadStream(options) {
+    options = options || {};
+
+    var start = typeof options.start === 'number' ? options.start : 0;
+    var end = typeof options.end === 'number' ? options.end + 1 : this.size;
+
+    if (start < 0 || end < 0 || start !== Math.floor(start) || end !== Math.floor(end))
+      throw new RangeError('Invalid range for createReadStream()');
+
+    var decoder = new ParallelDecoder(options);
+    decoder._begin(this, start, Math.min(end, this.size));
+    return decoder;
+  }
+}
+
+function promiseOrCallback(promise, callback) {
+  if (typeof callback !== 'function')
+    return promise;
+
+  promise.then(function(result) {
+    process.nextTick(callback, null, result);
+  }, function(err) {
+    process.nextTick(callback, err, null);
+  });
+}
+
+exports.openReader = function(source, options, callback) {
+  if (typeof options === 'function') {
+    callback = options;
+    options = {};
+  }
+
+  var result = {};
+  var promise = new Promise(function(resolve, reject) {
+    result.resolve = resolve;
+    result.reject = reject;
   });
+
+  openReader(source, options || {}, function(err, reader) {
+    if (err)
+      result.reject(err);
+    else
+      result.resolve(reader);
+  });
+
+  return promiseOrCallback(promise, callback);
 };
 
-function cleanupIndexInfo(info) {
+class ParallelDecoder extends stream.Readable {
+  constructor(options) {
+    super(options);
+
+    this._threads = options.threads || Math.max(os.cpus().length, 1);
+    this._maxInFlightBytes = options.maxInFlightBytes || 64 * 1024 * 1024;
+    this._reader = null;
+    this._fallback = null;
+    this._start = 0;
+    this._end = 0;
+    this._nextDispatch = 0;
+    this._nextPush = 0;
+    this._lastBlock = -1;
+    this._pending = 0;
+    this._inFlightBytes = 0;
+    this._decoded = {};
+    this._wantData = false;
+  }
+
+  // Decode the uncompressed bytes from start up to (excluding) end.
+  _begin(reader, start, end) {
+    this._reader = reader;
+    this._start = start;
+    this._end = end;
+
+    if (start >= end) {
+      this.push(null);
+      return;
+    }
+
+    this._nextDispatch = this._nextPush = reader._decoder.locate(start);
+    this._lastBlock = reader._decoder.locate(end - 1);
+    this._pump();
+  }
+
+  _startFallback(source, options) {
+    var decoder = this._fallback = createStream('autoDecoder', {
+      memlimit: options.memlimit
+    });
+
+    decoder.on('data', (chunk) => {
+      if (!this.push(chunk))
+        decoder.pause();
+    });
+
+    decoder.on('end', () => this.push(null));
+    decoder.on('error', (err) => this.destroy(err));
+
+    if (typeof source === 'number')
+      fs.createReadStream(null, { fd: source, autoClose: false, start: 0 }).pipe(decoder);
+    else
+      decoder.end(source);
+  }
+
+  _read() {
+    if (this._fallback) {
+      this._fallback.resume();
+      return;
+    }
+
+    this._wantData = true;
+    this._pump();
+  }
+
+  // Start decoding further blocks, as long as the consumer wants data and
+  // the limits for concurrently decoded blocks and their memory allow it.
+  _pump() {
+    while (this._reader && this._wantData &&
+           this._pending < this._threads &&
+           this._nextDispatch <= this._lastBlock) {
+      var block = this._reader._decoder.block(this._nextDispatch);
+      var size = block.compressedSize + block.uncompressedSize;
+
+      // A single block is always admitted, so that blocks that are larger
+      // than the limit can still be decoded.
+      if (this._inFlightBytes > 0 && this._inFlightBytes + size > this._maxInFlightBytes)
+        break;
+
+      this._dispatch(this._nextDispatch++, block.uncompressedOffset, size);
+    }
+  }
+
+  _dispatch(index, offset, size) {
+    this._pending++;
+    this._inFlightBytes += size;
+
+    this._reader._decodeBlock(index, (err, buffer) => {
+      this._pending--;
+
+      if (this.destroyed)
+        return;
+
+      if (err)
+        return this.destroy(err);
+
+      this._decoded[index] = { buffer: buffer, offset: offset, size: size };
+      this._flush();
+    });
+  }
+
+  // Push decoded blocks in order, limited to the requested range.
+  _flush() {
+    while (this._decoded[this._nextPush]) {
+      var entry = this._decoded[this._nextPush];
+      delete this._decoded[this._nextPush];
+      this._nextPush++;
+      this._inFlightBytes -= entry.size;
+
+      var buffer = entry.buffer.slice(
+        Math.max(this._start - entry.offset, 0),
+        Math.min(this._end - entry.offset, entry.buffer.length));
+
+      if (buffer.length > 0 && !this.push(buffer))
+        this._wantData = false;
+    }
+
+    if (this._nextPush > this._lastBlock) {
+      this.push(null);
+      return;
+    }
+
+    this._pump();
+  }
+
+  _destroy(err, callback) {
+    if (this._fallback)
+      this._fallback.destroy();
+
+    this._decoded = {};
+    callback(err);
+  }
+}
+
+exports.createParallelDecoder = function(source, options) {
+  options = options || {};
+
+  var decoder = new ParallelDecoder(options);
+
+  openReader(source, options, function(err, reader) {
+    if (decoder.destroyed)
+      return;
+
+    if (err)
+      return decoder.destroy(err);
+
+    // There is nothing to parallelize for a single block.
+    if (reader.blocks <= 1 && (typeof source === 'number' || Buffer.isBuffer(source)))
+      decoder._startFallback(source, options);
+    else
+      decoder._begin(reader, 0, reader.size);
+  });
+
+  return decoder;
+};
+
+function cleanupIndexInfo(info, parser, options) {
   var checkFlags = info.checks;
 
   info.checks = [];
@@ -558,36 +1270,32 @@ function cleanupIndexInfo(info) {
       info.checks.push(i);
   }
 
-  return info;
-}
-
-function skipLeadingZeroes(buffer) {
-  var i;
-  for (i = 0; i < buffer.length; i++) {
-    if (buffer[i] !== 0x00)
-      break;
-  }
+  if (options && options.blockTable)
+    info.blockTable = new BlockTable(parser.blockTable(options.blockTable === 'bigint'));
 
-  return buffer.slice(i);
+  return info;
 }
 
-function bufferIndexOfYZ(chunk) {
-  if (!chunk) {
-    return -1;
+// All blocks of a file as one typed array per field, rather than one object
+// per block. Offsets and sizes are Float64Arrays, or BigUint64Arrays if
+// requested with blockTable: 'bigint'.
+class BlockTable {
+  constructor(columns) {
+    Object.assign(this, columns);
   }
 
-  if (chunk.indexOf) {
-    return chunk.indexOf('YZ');
-  }
+  // Index of the block containing the given uncompressed offset,
+  // or -1 if there is no such block.
+  locate(offset) {
+    var last = this.count - 1;
 
-  var i;
-  for (i = 0; i < chunk.length - 1; i++) {
-    if (chunk[i] === 0x59 && chunk[i+1] === 0x5a) {
-      return i;
+    if (last < 0 || offset < 0 ||
+        offset >= this.uncompressedOffset[last] + this.uncompressedSize[last]) {
+      return -1;
     }
-  }
 
-  return -1;
+    return native.locateBlock_(this.uncompressedOffset, offset);
+  }
 }
 
 function noop() {}
@@ -0,0 +1,242 @@
+#include "liblzma-node.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace lzma {
+
+namespace {
+  // Smaller allocations are left to malloc(), which handles them well.
+  const size_t kMinCachedSize = 64 * 1024;
+
+  const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  // Extra room on top of each size class. liblzma's large allocations are
+  // mostly a power of two plus a few bytes (plus the header that
+  // LZMAStream::allocation() adds), which would otherwise always end up in
+  // the next larger class.
+  const size_t kClassSlack = 4096;
+
+  // Keyed by capacity and whether the block uses huge pages.
+  typedef std::map<std::pair<size_t, bool>, std::vector<void*>> BlockMap;
+
+  struct CacheState {
+    CacheState() : retainedBytes(0), maxRetainedBytes(128 * 1024 * 1024), hits(0), misses(0) {}
+
+    std::mutex mutex;
+    // Only environments that are currently alive have an entry here.
+    std::map<napi_env, BlockMap> blocks;
+    size_t retainedBytes;
+    size_t maxRetainedBytes;
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  CacheState& cache() {
+    static CacheState* state = new CacheState();
+    return *state;
+  }
+
+  // Free blocks of env until at most maxRetainedBytes are retained.
+  // The mutex needs to be held. Returns the number of bytes freed.
+  size_t trim(CacheState& c, BlockMap* blocks) {
+    size_t freed = 0;
+
+    // Start with the largest blocks.
+    auto it = blocks->end();
+    while (c.retainedBytes > c.maxRetainedBytes && it != blocks->begin()) {
+      --it;
+
+      while (c.retainedBytes > c.maxRetainedBytes && !it->second.empty()) {
+        ::free(it->second.back());
+        it->second.pop_back();
+        c.retainedBytes -= it->first.first;
+        freed += it->first.first;
+      }
+
+      if (it->second.empty())
+        it = blocks->erase(it);
+    }
+
+    return freed;
+  }
+
+  void releaseEnvBlocks(void* arg) {
+    napi_env env = static_cast<napi_env>(arg);
+    CacheState& c = cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    auto it = c.blocks.find(env);
+    if (it == c.blocks.end())
+      return;
+
+    for (auto& entry : it->second) {
+      for (void* block : entry.second) {
+        ::free(block);
+        c.retainedBytes -= entry.first.first;
+      }
+    }
+
+    c.blocks.erase(it);
+  }
+}
+
+size_t BlockCache::SizeClass(size_t size) {
+  if (size < kMinCachedSize)
+    return size;
+
+  // Use eight size classes per power of two, so that at most an eighth of
+  // each block goes unused.
+  size_t payload = size - kClassSlack;
+  size_t step = 1;
+  while (step <= payload / 2)
+    step <<= 1;
+  step /= 8;
+
+  return (payload + step - 1) / step * step + kClassSlack;
+}
+
+void* BlockCache::AllocateBlock(size_t capacity, bool hugePages, size_t prefaultLength) {
+  void* block = nullptr;
+
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+  if (hugePages) {
+    if (posix_memalign(&block, kHugePageSize, capacity) != 0)
+      return nullptr;
+
+    // Only whole huge pages can be backed by huge pages.
+    size_t hugeLength = capacity / kHugePageSize * kHugePageSize;
+    if (hugeLength > 0)
+      madvise(block, hugeLength, MADV_HUGEPAGE);
+  }
+#endif
+
+  if (block == nullptr) {
+    block = ::malloc(capacity);
+    if (block == nullptr)
+      return nullptr;
+  }
+
+  if (prefaultLength > 0) {
+#ifndef _WIN32
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    static const size_t pageSize = 4096;
+#endif
+    volatile uint8_t* bytes = static_cast<volatile uint8_t*>(block);
+
+    // The rest of the block is only committed if it is used later.
+    for (size_t i = 0; i < std::min(prefaultLength, capacity); i += pageSize)
+      bytes[i] = 0;
+  }
+
+  return block;
+}
+
+void* BlockCache::Acquire(napi_env env, size_t capacity, bool hugePages) {
+  if (capacity < kMinCachedSize)
+    return nullptr;
+
+  CacheState& c = cache();
+  std::lock_guard<std::mutex> lock(c.mutex);
+
+  auto envIt = c.blocks.find(env);
+  if (envIt == c.blocks.end())
+    return nullptr;
+
+  auto it = envIt->second.find(std::make_pair(capacity, hugePages));
+  if (it == envIt->second.end() || it->second.empty()) {
+    c.misses++;
+    return nullptr;
+  }
+
+  void* block = it->second.back();
+  it->second.pop_back();
+  c.retainedBytes -= capacity;
+  c.hits++;
+
+  return block;
+}
+
+bool BlockCache::Release(napi_env env, void* block, size_t capacity, bool hugePages) {
+  if (capacity < kMinCachedSize)
+    return false;
+
+  CacheState& c = cache();
+  std::lock_guard<std::mutex> lock(c.mutex);
+
+  auto envIt = c.blocks.find(env);
+  if (envIt == c.blocks.end() || c.retainedBytes + capacity > c.maxRetainedBytes)
+    return false;
+
+  envIt->second[std::make_pair(capacity, hugePages)].push_back(block);
+  c.retainedBytes += capacity;
+  return true;
+}
+
+void BlockCache::InitializeExports(Object exports) {
+  napi_env env = exports.Env();
+
+  {
+    CacheState& c = cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    c.blocks[env];
+  }
+
+  napi_add_env_cleanup_hook(env, releaseEnvBlocks, env);
+
+  exports["blockCacheStats"] = Function::New(exports.Env(), GetStats);
+  exports["setBlockCacheLimit"] = Function::New(exports.Env(), SetLimit);
+}
+
+Napi::Value BlockCache::GetStats(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  CacheState& c = cache();
+  std::lock_guard<std::mutex> lock(c.mutex);
+
+  size_t retainedBlocks = 0;
+  for (const auto& envEntry : c.blocks) {
+    for (const auto& entry : envEntry.second)
+      retainedBlocks += entry.second.size();
+  }
+
+  Object obj = Object::New(env);
+  obj["hits"] = Number::New(env, static_cast<double>(c.hits));
+  obj["misses"] = Number::New(env, static_cast<double>(c.misses));
+  obj["retainedBlocks"] = Number::New(env, static_cast<double>(retainedBlocks));
+  obj["retainedBytes"] = Number::New(env, static_cast<double>(c.retainedBytes));
+  obj["maxRetainedBytes"] = Number::New(env, static_cast<double>(c.maxRetainedBytes));
+
+  return obj;
+}
+
+Napi::Value BlockCache::SetLimit(const CallbackInfo& info) {
+  if (!info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0)
+    throw TypeError::New(info.Env(), "setBlockCacheLimit() needs a non-negative numerical argument");
+
+  size_t newLimit = static_cast<size_t>(info[0].As<Number>().Int64Value());
+  size_t oldLimit, freed = 0;
+
+  CacheState& c = cache();
+  {
+    std::lock_guard<std::mutex> lock(c.mutex);
+
+    oldLimit = c.maxRetainedBytes;
+    c.maxRetainedBytes = newLimit;
+
+    auto envIt = c.blocks.find(info.Env());
+    if (envIt != c.blocks.end())
+      freed = trim(c, &envIt->second);
+  }
+
+  MemoryManagement::AdjustExternalMemory(info.Env(), -static_cast<int64_t>(freed));
+
+  return Number::New(info.Env(), static_cast<double>(oldLimit));
+}
+
+}
@@ -0,0 +1,296 @@
+#include "liblzma-node.hpp"
+#include <uv.h>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace lzma {
+
+namespace {
+  class BlockDecodingTask : public CodingThreadPool::Task {
+    public:
+      BlockDecodingTask(Function callback, BlockDecoder* decoder, size_t index,
+                        Napi::Value input)
+        : callback(Persistent(callback)),
+          decoder(decoder),
+          index(index),
+          input(nullptr),
+          inputLength(0),
+          out(nullptr),
+          result(LZMA_OK),
+          ioError(0),
+          allocator(callback.Env()) {
+        // Keeps the decoder and the input alive while they are being read
+        // on the pool thread.
+        decoder->Ref();
+
+        if (!input.IsUndefined() && !input.IsNull()) {
+          readBufferPointerFromObj(input, &this->input, &inputLength);
+          inputRef = Persistent(input.As<Object>());
+        }
+      }
+
+      ~BlockDecodingTask() {
+        ::free(out);
+        decoder->Unref();
+      }
+
+      void Execute() override {
+        size_t size = decoder->block(index).uncompressedSize;
+
+        // The index is not verified until the block has been decoded, so it
+        // cannot be trusted with an allocation larger than the memory limit.
+        if (size > decoder->memoryLimit()) {
+          result = LZMA_MEMLIMIT_ERROR;
+          return;
+        }
+
+        // malloc() may return nullptr for size 0 even on success.
+        out = static_cast<uint8_t*>(::malloc(std::max<size_t>(size, 1)));
+        if (!out) {
+          result = LZMA_MEM_ERROR;
+          return;
+        }
+
+        result = decoder->decodeBlock(index, out, allocator.get(),
+                                      input, inputLength, &ioError);
+      }
+
+      void OnComplete(Napi::Env env) override {
+        if (ioError != 0) {
+          Error error = Error::New(env, uv_strerror(ioError));
+          error.Value()["code"] = String::New(env, uv_err_name(ioError));
+          callback.Call({ error.Value() });
+          return;
+        }
+
+        if (result != LZMA_OK) {
+          callback.Call({ lzmaRetError(env, result).Value() });
+          return;
+        }
+
+        size_t size = decoder->block(index).uncompressedSize;
+        uint8_t* data = out;
+        out = nullptr;
+
+        callback.Call({ env.Null(), MallocedBuffer(env, data, size) });
+      }
+
+    private:
+      FunctionReference callback;
+      ObjectReference inputRef;
+      BlockDecoder* decoder;
+      size_t index;
+      const uint8_t* input;
+      size_t inputLength;
+      uint8_t* out;
+      lzma_ret result;
+      int ioError;
+      DetachedAllocator allocator;
+  };
+}
+
+void BlockDecoder::InitializeExports(Object exports) {
+  exports["BlockDecoder"] = DefineClass(exports.Env(), "BlockDecoder", {
+    InstanceMethod("blockCount", &BlockDecoder::BlockCount),
+    InstanceMethod("block", &BlockDecoder::GetBlock),
+    InstanceMethod("locate", &BlockDecoder::Locate),
+    InstanceMethod("decode", &BlockDecoder::Decode),
+  });
+}
+
+BlockDecoder::BlockDecoder(const CallbackInfo& info) :
+  ObjectWrap(info),
+  sourceData(nullptr),
+  sourceLength(0),
+  fd(-1),
+  memlimit(NumberToUint64ClampNullMax(info[2]))
+{
+  if (!info[0].IsObject())
+    throw TypeError::New(Env(), "BlockDecoder needs a parsed IndexParser");
+
+  const lzma_index* index = IndexParser::Unwrap(info[0].As<Object>())->index();
+  if (index == nullptr)
+    throw TypeError::New(Env(), "BlockDecoder needs a parsed IndexParser");
+
+  if (info[1].IsNumber()) {
+    fd = info[1].As<Number>().Int32Value();
+  } else if (!info[1].IsUndefined() && !info[1].IsNull()) {
+    readBufferPointerFromObj(info[1], &sourceData, &sourceLength);
+    source = Persistent(info[1].As<Object>());
+  }
+
+  blocks.reserve(lzma_index_block_count(index));
+
+  lzma_index_iter iter;
+  lzma_index_iter_init(&iter, index);
+
+  while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+    Block block;
+    block.compressedOffset = iter.block.compressed_file_offset;
+    block.totalSize = iter.block.total_size;
+    block.unpaddedSize = iter.block.unpadded_size;
+    block.uncompressedOffset = iter.block.uncompressed_file_offset;
+    block.uncompressedSize = iter.block.uncompressed_size;
+    block.check = iter.stream.flags ? iter.stream.flags->check : LZMA_CHECK_NONE;
+
+    if (block.uncompressedSize > SIZE_MAX || block.totalSize > SIZE_MAX)
+      throw lzmaRetError(Env(), LZMA_MEM_ERROR);
+
+    blocks.push_back(block);
+  }
+}
+
+int BlockDecoder::readBlock(const Block& block, std::vector<uint8_t>* buf, const uint8_t** data) {
+  if (fd < 0) {
+    if (sourceData == nullptr)
+      return UV_EINVAL;
+
+    if (block.compressedOffset > sourceLength ||
+        block.totalSize > sourceLength - block.compressedOffset) {
+      return UV_EOF;
+    }
+
+    *data = sourceData + block.compressedOffset;
+    return 0;
+  }
+
+  buf->resize(block.totalSize);
+  size_t done = 0;
+
+  while (done < block.totalSize) {
+    uv_fs_t req;
+    uv_buf_t uvbuf = uv_buf_init(reinterpret_cast<char*>(buf->data() + done),
+        static_cast<unsigned int>(std::min<size_t>(block.totalSize - done, 1 << 30)));
+
+    // Without a loop and a callback, this reads synchronously.
+    int r = uv_fs_read(nullptr, &req, fd, &uvbuf, 1, block.compressedOffset + done, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (r < 0)
+      return r;
+    if (r == 0)
+      return UV_EOF;
+
+    done += r;
+  }
+
+  *data = buf->data();
+  return 0;
+}
+
+lzma_ret BlockDecoder::decodeBlock(size_t i, uint8_t* out, const lzma_allocator* allocator,
+                                   const uint8_t* input, size_t inputLength, int* ioError) {
+  const Block& b = blocks[i];
+  std::vector<uint8_t> buf;
+  const uint8_t* in = input;
+
+  if (input != nullptr)
+    *ioError = inputLength < b.totalSize ? UV_EOF : 0;
+  else
+    *ioError = readBlock(b, &buf, &in);
+
+  if (*ioError != 0)
+    return LZMA_DATA_ERROR;
+
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_block block;
+  std::memset(&block, 0, sizeof(block));
+  block.version = 1;
+  block.check = b.check;
+  block.filters = filters;
+  block.header_size = lzma_block_header_size_decode(in[0]);
+
+  // A zero byte indicates the index rather than a block header.
+  if (b.totalSize == 0 || in[0] == 0 || block.header_size > b.totalSize)
+    return LZMA_DATA_ERROR;
+
+  // On failure, this frees the filter options itself.
+  lzma_ret ret = lzma_block_header_decode(&block, allocator, in);
+  if (ret != LZMA_OK)
+    return ret;
+
+  ret = lzma_block_compressed_size(&block, b.unpaddedSize);
+
+  if (ret == LZMA_OK && block.uncompressed_size != LZMA_VLI_UNKNOWN &&
+      block.uncompressed_size != b.uncompressedSize) {
+    ret = LZMA_DATA_ERROR;
+  }
+
+  if (ret == LZMA_OK && lzma_raw_decoder_memusage(filters) > memlimit)
+    ret = LZMA_MEMLIMIT_ERROR;
+
+  if (ret == LZMA_OK) {
+    size_t inPos = block.header_size;
+    size_t outPos = 0;
+
+    block.uncompressed_size = b.uncompressedSize;
+    ret = lzma_block_buffer_decode(&block, allocator,
+                                   in, &inPos, b.totalSize,
+                                   out, &outPos, b.uncompressedSize);
+
+    if (ret == LZMA_OK && outPos != b.uncompressedSize)
+      ret = LZMA_DATA_ERROR;
+  }
+
+  for (size_t j = 0; filters[j].id != LZMA_VLI_UNKNOWN; j++)
+    allocator->free(allocator->opaque, filters[j].options);
+
+  return ret;
+}
+
+Napi::Value BlockDecoder::BlockCount(const CallbackInfo& info) {
+  return Number::New(Env(), static_cast<double>(blocks.size()));
+}
+
+Napi::Value BlockDecoder::GetBlock(const CallbackInfo& info) {
+  uint64_t i = NumberToUint64ClampNullMax(info[0]);
+  if (i >= blocks.size())
+    throw RangeError::New(Env(), "Invalid block index");
+
+  const Block& b = blocks[i];
+  Object obj = Object::New(Env());
+  obj["compressedOffset"] = Number::New(Env(), static_cast<double>(b.compressedOffset));
+  obj["compressedSize"] = Number::New(Env(), static_cast<double>(b.totalSize));
+  obj["uncompressedOffset"] = Number::New(Env(), static_cast<double>(b.uncompressedOffset));
+  obj["uncompressedSize"] = Number::New(Env(), static_cast<double>(b.uncompressedSize));
+  obj["check"] = Number::New(Env(), b.check);
+
+  return obj;
+}
+
+// Return the block that contains uncompressedOffset, which needs to be
+// less than the total uncompressed size.
+size_t BlockDecoder::locate(uint64_t uncompressedOffset) const {
+  auto it = std::upper_bound(blocks.begin(), blocks.end(), uncompressedOffset,
+      [](uint64_t offset, const Block& block) {
+        return offset < block.uncompressedOffset;
+      });
+
+  return it - blocks.begin() - 1;
+}
+
+Napi::Value BlockDecoder::Locate(const CallbackInfo& info) {
+  uint64_t offset = NumberToUint64ClampNullMax(info[0]);
+
+  if (blocks.empty() ||
+      offset >= blocks.back().uncompressedOffset + blocks.back().uncompressedSize) {
+    return Env().Null();
+  }
+
+  return Number::New(Env(), static_cast<double>(locate(offset)));
+}
+
+void BlockDecoder::Decode(const CallbackInfo& info) {
+  uint64_t i = NumberToUint64ClampNullMax(info[0]);
+  if (i >= blocks.size())
+    throw RangeError::New(Env(), "Invalid block index");
+
+  if (!info[1].IsFunction())
+    throw TypeError::New(Env(), "BlockDecoder::Decode needs a callback");
+
+  CodingThreadPool::Post(Env(), new BlockDecodingTask(
+      info[1].As<Function>(), this, static_cast<size_t>(i), info[2]));
+}
+
+}
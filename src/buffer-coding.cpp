@@ -0,0 +1,345 @@
+#include "liblzma-node.hpp"
+#include <cstdlib>
+#include <algorithm>
+
+namespace lzma {
+
+namespace {
+  class BufferCodingWorker : public AsyncWorker {
+    public:
+      BufferCodingWorker(Function callback, Object input, bool encode,
+                         const uint8_t* in, size_t inSize)
+        : AsyncWorker(callback, "BufferCodingWorker"),
+          coder(callback.Env(), encode, in, inSize) {
+        // Keeps the input alive while it is being read on the worker thread.
+        Receiver().Set(static_cast<uint32_t>(0), input);
+      }
+
+      void Execute() override {
+        coder.Run();
+      }
+
+      BufferCoder coder;
+
+    private:
+      void OnOK() override {
+        Napi::Env env = Env();
+        Napi::Value error = env.Null();
+        Napi::Value result = env.Null();
+
+        try {
+          result = coder.TakeResult(env);
+        } catch (const Error& e) {
+          error = e.Value();
+        }
+
+        Callback().Call({ error, result });
+      }
+  };
+
+  Napi::Value codeBuffer(const CallbackInfo& info, bool encode, bool alone) {
+    Napi::Env env = info.Env();
+    const uint8_t* data;
+    size_t length;
+
+    readBufferPointerFromObj(info[0], &data, &length);
+
+    uint32_t preset = LZMA_PRESET_DEFAULT;
+    lzma_check check = LZMA_CHECK_CRC32;
+    uint64_t memlimit = UINT64_MAX;
+    lzma_options_lzma aloneOptions = {};
+    Napi::Value callback;
+
+    if (alone) {
+      aloneOptions = parseOptionsLZMA(info[1]);
+      callback = info[2];
+    } else if (encode) {
+      preset = info[1].ToNumber().Uint32Value();
+      check = static_cast<lzma_check>(info[2].ToNumber().Int32Value());
+      callback = info[3];
+
+      // Report invalid options right away, as the stream encoders do.
+      if (lzma_easy_encoder_memusage(preset) == UINT64_MAX)
+        throw lzmaRetError(env, LZMA_OPTIONS_ERROR);
+      if (!lzma_check_is_supported(check))
+        throw lzmaRetError(env, LZMA_UNSUPPORTED_CHECK);
+    } else {
+      memlimit = NumberToUint64ClampNullMax(info[1]);
+      callback = info[2];
+    }
+
+    if (!callback.IsFunction()) {
+      BufferCoder coder(env, encode, data, length);
+      coder.preset = preset;
+      coder.check = check;
+      coder.memlimit = memlimit;
+      coder.alone = alone;
+      coder.aloneOptions = aloneOptions;
+      coder.Run();
+      return coder.TakeResult(env);
+    }
+
+    BufferCodingWorker* worker = new BufferCodingWorker(
+        callback.As<Function>(), info[0].As<Object>(), encode, data, length);
+    worker->coder.preset = preset;
+    worker->coder.check = check;
+    worker->coder.memlimit = memlimit;
+    worker->coder.alone = alone;
+    worker->coder.aloneOptions = aloneOptions;
+    worker->Queue();
+
+    return env.Undefined();
+  }
+
+  Napi::Value CompressBuffer(const CallbackInfo& info) {
+    return codeBuffer(info, true, false);
+  }
+
+  Napi::Value AloneCompressBuffer(const CallbackInfo& info) {
+    return codeBuffer(info, true, true);
+  }
+
+  Napi::Value DecompressBuffer(const CallbackInfo& info) {
+    return codeBuffer(info, false, false);
+  }
+}
+
+BufferCoder::BufferCoder(napi_env env, bool encode, const uint8_t* in, size_t inSize) :
+  preset(LZMA_PRESET_DEFAULT),
+  check(LZMA_CHECK_CRC32),
+  memlimit(UINT64_MAX),
+  alone(false),
+  aloneOptions(),
+  encode(encode),
+  in(in),
+  inSize(inSize),
+  out(nullptr),
+  outSize(0),
+  outCapacity(0),
+  result(LZMA_PROG_ERROR),
+  allocator(env)
+{
+}
+
+BufferCoder::~BufferCoder() {
+  releaseOutput();
+}
+
+void BufferCoder::InitializeExports(Object exports) {
+  Napi::Env env = exports.Env();
+
+  exports["compressBuffer_"] = Function::New(env, CompressBuffer);
+  exports["aloneCompressBuffer_"] = Function::New(env, AloneCompressBuffer);
+  exports["decompressBuffer_"] = Function::New(env, DecompressBuffer);
+}
+
+bool BufferCoder::reserveOutput(size_t capacity) {
+  // realloc() may return nullptr for size 0 even on success.
+  capacity = std::max<size_t>(capacity, 1);
+
+  uint8_t* newOut = static_cast<uint8_t*>(::realloc(out, capacity));
+  if (!newOut)
+    return false;
+
+  out = newOut;
+  outCapacity = capacity;
+  return true;
+}
+
+void BufferCoder::releaseOutput() {
+  ::free(out);
+  out = nullptr;
+  outSize = 0;
+  outCapacity = 0;
+}
+
+void BufferCoder::Run() {
+  result = encode ? compress() : decompress();
+
+  if (result != LZMA_OK)
+    releaseOutput();
+}
+
+lzma_ret BufferCoder::compress() {
+  if (alone)
+    return compressAlone();
+
+  if (!reserveOutput(lzma_stream_buffer_bound(inSize)))
+    return LZMA_MEM_ERROR;
+
+  return lzma_easy_buffer_encode(preset, check, allocator.get(),
+                                 in, inSize, out, &outSize, outCapacity);
+}
+
+// liblzma has no buffer encoder for the .lzma format, so run the stream
+// encoder to completion instead. LZMA1 can expand incompressible input a
+// bit more than LZMA2, so the output buffer may still need to grow.
+lzma_ret BufferCoder::compressAlone() {
+  if (!reserveOutput(lzma_stream_buffer_bound(inSize)))
+    return LZMA_MEM_ERROR;
+
+  lzma_stream strm = LZMA_STREAM_INIT;
+  strm.allocator = allocator.get();
+
+  lzma_ret ret = lzma_alone_encoder(&strm, &aloneOptions);
+  strm.next_in = in;
+  strm.avail_in = inSize;
+
+  while (ret == LZMA_OK) {
+    if (outSize == outCapacity && !reserveOutput(outCapacity * 2)) {
+      ret = LZMA_MEM_ERROR;
+      break;
+    }
+
+    strm.next_out = out + outSize;
+    strm.avail_out = outCapacity - outSize;
+
+    ret = lzma_code(&strm, LZMA_FINISH);
+    outSize = strm.next_out - out;
+  }
+
+  lzma_end(&strm);
+  return ret == LZMA_STREAM_END ? LZMA_OK : ret;
+}
+
+lzma_ret BufferCoder::decompress() {
+  uint64_t size;
+
+  // The index is not verified until the blocks have been decoded, so it
+  // cannot be trusted with an allocation larger than the memory limit.
+  if (uncompressedSizeFromIndex(&size) && size <= SIZE_MAX && size <= memlimit &&
+      reserveOutput(static_cast<size_t>(size))) {
+    uint64_t limit = memlimit;
+    size_t inPos = 0;
+
+    lzma_ret ret = lzma_stream_buffer_decode(&limit, LZMA_CONCATENATED, allocator.get(),
+                                             in, &inPos, inSize,
+                                             out, &outSize, outCapacity);
+
+    // Streams are more lenient about padding between concatenated .xz
+    // streams, so give the input another chance in that case.
+    if (ret != LZMA_DATA_ERROR && ret != LZMA_FORMAT_ERROR)
+      return ret;
+
+    outSize = 0;
+  }
+
+  return decompressStreaming();
+}
+
+// Sum up the uncompressed sizes from the indexes of all .xz streams in the
+// input, going backwards from the end of the input. Returns false if the
+// input does not consist of .xz streams and padding only.
+bool BufferCoder::uncompressedSizeFromIndex(uint64_t* size) {
+  uint64_t total = 0;
+  size_t pos = inSize;
+
+  while (pos > 0) {
+    // Stream padding. Stream footers always end in the non-zero 'YZ'.
+    while (pos > 0 && in[pos - 1] == 0)
+      pos--;
+
+    if (pos == 0)
+      break;
+
+    if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+      return false;
+
+    lzma_stream_flags footer;
+    const uint8_t* footerStart = in + pos - LZMA_STREAM_HEADER_SIZE;
+    if (lzma_stream_footer_decode(&footer, footerStart) != LZMA_OK)
+      return false;
+
+    if (footer.backward_size > pos - 2 * LZMA_STREAM_HEADER_SIZE)
+      return false;
+
+    lzma_index* index = nullptr;
+    uint64_t indexMemlimit = UINT64_MAX;
+    size_t indexPos = pos - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+
+    if (lzma_index_buffer_decode(&index, &indexMemlimit, allocator.get(),
+                                 in, &indexPos, pos - LZMA_STREAM_HEADER_SIZE) != LZMA_OK) {
+      return false;
+    }
+
+    uint64_t uncompressedSize = lzma_index_uncompressed_size(index);
+    uint64_t streamSize = lzma_index_stream_size(index);
+    lzma_index_end(index, allocator.get());
+
+    if (streamSize > pos || uncompressedSize > UINT64_MAX - total)
+      return false;
+
+    total += uncompressedSize;
+    pos -= streamSize;
+  }
+
+  *size = total;
+  return true;
+}
+
+// Decode input of unknown size (e.g. .lzma files) with a growing output
+// buffer. Like streams, this accepts zero padding and any number of
+// concatenated streams.
+lzma_ret BufferCoder::decompressStreaming() {
+  if (!reserveOutput(std::max<size_t>(inSize * 4, 4096)))
+    return LZMA_MEM_ERROR;
+
+  size_t inPos = 0;
+
+  while (true) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    strm.allocator = allocator.get();
+
+    lzma_ret ret = lzma_auto_decoder(&strm, memlimit, 0);
+    strm.next_in = in + inPos;
+    strm.avail_in = inSize - inPos;
+
+    while (ret == LZMA_OK) {
+      if (outSize == outCapacity && !reserveOutput(outCapacity * 2)) {
+        ret = LZMA_MEM_ERROR;
+        break;
+      }
+
+      strm.next_out = out + outSize;
+      strm.avail_out = outCapacity - outSize;
+
+      ret = lzma_code(&strm, LZMA_FINISH);
+      outSize = strm.next_out - out;
+    }
+
+    inPos = inSize - strm.avail_in;
+    lzma_end(&strm);
+
+    if (ret != LZMA_STREAM_END)
+      return ret;
+
+    while (inPos < inSize && in[inPos] == 0)
+      inPos++;
+
+    if (inPos == inSize)
+      return LZMA_OK;
+  }
+}
+
+Napi::Value BufferCoder::TakeResult(Napi::Env env) {
+  if (result != LZMA_OK)
+    throw lzmaRetError(env, result);
+
+  uint8_t* data = out;
+  size_t length = outSize;
+
+  // Mostly-empty output is copied so that JS does not hold on to a lot of
+  // unused memory. That is the common case for compression.
+  if (length >= outCapacity / 2) {
+    out = nullptr;
+    outSize = 0;
+    outCapacity = 0;
+    return MallocedBuffer(env, data, length);
+  }
+
+  Napi::Value buffer = Buffer<uint8_t>::Copy(env, data, length);
+  releaseOutput();
+  return buffer;
+}
+
+}
@@ -0,0 +1,205 @@
+#include "liblzma-node.hpp"
+#include <cstring>
+#include <map>
+
+namespace lzma {
+
+namespace {
+  struct PooledCoder {
+    lzma_stream strm;
+    uint64_t size;
+  };
+
+  typedef std::pair<napi_env, std::string> PoolKey;
+
+  struct PoolState {
+    PoolState() : retainedBytes(0), maxRetainedBytes(256 * 1024 * 1024), hits(0), misses(0) {}
+
+    std::mutex mutex;
+    std::map<PoolKey, std::vector<PooledCoder>> coders;
+    std::set<napi_env> envsWithCleanupHook;
+    uint64_t retainedBytes;
+    uint64_t maxRetainedBytes;
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  PoolState& pool() {
+    static PoolState* state = new PoolState();
+    return *state;
+  }
+
+  // Pooled coders are released outside of any LZMAStream, so lzma_end()
+  // gets an allocator that only counts how much memory was freed.
+  struct ReleaseContext {
+    napi_env env;
+    uint64_t freed;
+  };
+
+  extern "C" void* LZMA_API_CALL
+  alloc_for_release(void* opaque, size_t nmemb, size_t size) {
+    return nullptr;
+  }
+
+  extern "C" void LZMA_API_CALL
+  free_for_release(void* opaque, void* ptr) {
+    ReleaseContext* ctx = static_cast<ReleaseContext*>(opaque);
+    size_t capacity;
+
+    ctx->freed += LZMAStream::freeAllocation(ctx->env, ptr, &capacity);
+  }
+
+  uint64_t releaseCoder(napi_env env, PooledCoder* coder) {
+    ReleaseContext ctx = { env, 0 };
+    lzma_allocator allocator = { alloc_for_release, free_for_release, &ctx };
+
+    coder->strm.allocator = &allocator;
+    lzma_end(&coder->strm);
+    return ctx.freed;
+  }
+
+  // Release coders belonging to env until at most maxRetainedBytes are
+  // retained. The mutex needs to be held.
+  uint64_t trim(PoolState& p, napi_env env) {
+    uint64_t freed = 0;
+
+    for (auto it = p.coders.begin(); it != p.coders.end();) {
+      if (it->first.first != env) {
+        ++it;
+        continue;
+      }
+
+      while (p.retainedBytes > p.maxRetainedBytes && !it->second.empty()) {
+        p.retainedBytes -= it->second.back().size;
+        freed += releaseCoder(env, &it->second.back());
+        it->second.pop_back();
+      }
+
+      if (it->second.empty())
+        it = p.coders.erase(it);
+      else
+        ++it;
+    }
+
+    return freed;
+  }
+
+  void releaseEnvCoders(void* arg) {
+    napi_env env = static_cast<napi_env>(arg);
+    PoolState& p = pool();
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    for (auto it = p.coders.begin(); it != p.coders.end();) {
+      if (it->first.first != env) {
+        ++it;
+        continue;
+      }
+
+      for (PooledCoder& coder : it->second) {
+        p.retainedBytes -= coder.size;
+        releaseCoder(env, &coder);
+      }
+
+      it = p.coders.erase(it);
+    }
+
+    p.envsWithCleanupHook.erase(env);
+  }
+}
+
+bool CoderPool::Take(napi_env env, const std::string& key, lzma_stream* strm, uint64_t* size) {
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  auto it = p.coders.find(PoolKey(env, key));
+  if (it == p.coders.end() || it->second.empty()) {
+    p.misses++;
+    return false;
+  }
+
+  const lzma_allocator* allocator = strm->allocator;
+  PooledCoder& coder = it->second.back();
+
+  p.retainedBytes -= coder.size;
+  p.hits++;
+
+  *size = coder.size;
+
+  *strm = coder.strm;
+  strm->allocator = allocator;
+  it->second.pop_back();
+
+  return true;
+}
+
+bool CoderPool::Put(napi_env env, const std::string& key, lzma_stream* strm, uint64_t size) {
+  PooledCoder coder;
+  coder.size = size;
+
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  if (p.retainedBytes + coder.size > p.maxRetainedBytes)
+    return false;
+
+  if (p.envsWithCleanupHook.count(env) == 0) {
+    if (napi_add_env_cleanup_hook(env, releaseEnvCoders, env) != napi_ok)
+      return false;
+    p.envsWithCleanupHook.insert(env);
+  }
+
+  coder.strm = *strm;
+  coder.strm.allocator = nullptr;
+  coder.strm.next_in = nullptr;
+  coder.strm.avail_in = 0;
+  coder.strm.next_out = nullptr;
+  coder.strm.avail_out = 0;
+
+  p.coders[PoolKey(env, key)].push_back(coder);
+  p.retainedBytes += coder.size;
+
+  std::memset(strm, 0, sizeof(lzma_stream));
+  return true;
+}
+
+Napi::Value CoderPool::GetStats(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  size_t retainedCoders = 0;
+  for (const auto& entry : p.coders)
+    retainedCoders += entry.second.size();
+
+  Object obj = Object::New(env);
+  obj["hits"] = Number::New(env, static_cast<double>(p.hits));
+  obj["misses"] = Number::New(env, static_cast<double>(p.misses));
+  obj["retainedCoders"] = Number::New(env, static_cast<double>(retainedCoders));
+  obj["retainedBytes"] = Number::New(env, static_cast<double>(p.retainedBytes));
+  obj["maxRetainedBytes"] = Number::New(env, static_cast<double>(p.maxRetainedBytes));
+
+  return obj;
+}
+
+Napi::Value CoderPool::SetLimit(const CallbackInfo& info) {
+  if (!info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0)
+    throw TypeError::New(info.Env(), "setCoderPoolLimit() needs a non-negative numerical argument");
+
+  uint64_t newLimit = static_cast<uint64_t>(info[0].As<Number>().Int64Value());
+  uint64_t oldLimit, freed;
+
+  PoolState& p = pool();
+  {
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    oldLimit = p.maxRetainedBytes;
+    p.maxRetainedBytes = newLimit;
+    freed = trim(p, info.Env());
+  }
+
+  MemoryManagement::AdjustExternalMemory(info.Env(), -static_cast<int64_t>(freed));
+
+  return Number::New(info.Env(), static_cast<double>(oldLimit));
+}
+
+}
@@ -0,0 +1,485 @@
+#include "liblzma-node.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <thread>
+
+namespace lzma {
+
+namespace {
+  const int kPriorities = 2;
+
+  struct Worker {
+    Worker() : alive(false) {}
+
+    // Indexed by CodingThreadPool::Priority. The worker takes tasks from
+    // the front of its own queues, other workers steal from the back.
+    std::deque<LZMAStream*> queues[kPriorities];
+    bool alive;
+  };
+
+  struct StreamState {
+    StreamState(napi_env env = nullptr, uint64_t id = 0, int priority = 0)
+      : env(env), id(id), priority(priority),
+        queued(false), running(false), rerun(false), queuedAt() {}
+
+    napi_env env;
+    uint64_t id;
+    int priority;
+    bool queued;
+    bool running;
+    // More input arrived while the stream was running.
+    bool rerun;
+    std::chrono::steady_clock::time_point queuedAt;
+  };
+
+  struct EnvState {
+    napi_threadsafe_function tsfn;
+    // Streams of this environment that are queued or running.
+    size_t pending;
+  };
+
+  struct QueuedTask {
+    napi_env env;
+    CodingThreadPool::Task* task;
+  };
+
+  // Sent to the main thread each time a coding step or task has finished.
+  struct Completion {
+    LZMAStream* stream;
+    uint64_t id;
+    bool idle;
+    CodingThreadPool::Task* task; // nullptr for coding steps
+  };
+
+  struct PoolState {
+    PoolState() : targetThreads(0), nextWorker(0), nextId(0),
+                  quantumBytes(0), quantumNanos(0),
+                  tasks(0), steals(0), yields(0) {}
+
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable streamIdle;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::map<LZMAStream*, StreamState> streams;
+    // Tasks are not bound to a worker, so they do not need to be stolen.
+    std::deque<QueuedTask> queuedTasks;
+    std::map<napi_env, EnvState> envs;
+    size_t targetThreads;
+    size_t nextWorker;
+    uint64_t nextId;
+    uint64_t quantumBytes;
+    uint64_t quantumNanos;
+    uint64_t tasks;
+    uint64_t steals;
+    uint64_t yields;
+  };
+
+  PoolState& pool() {
+    static PoolState* state = new PoolState();
+    return *state;
+  }
+
+  size_t defaultThreads() {
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  // The mutex needs to be held.
+  LZMAStream* takeStream(PoolState& p, size_t self, int prio) {
+    std::deque<LZMAStream*>& own = p.workers[self]->queues[prio];
+    if (!own.empty()) {
+      LZMAStream* stream = own.front();
+      own.pop_front();
+      return stream;
+    }
+
+    for (size_t i = 1; i < p.workers.size(); i++) {
+      std::deque<LZMAStream*>& other = p.workers[(self + i) % p.workers.size()]->queues[prio];
+      if (!other.empty()) {
+        LZMAStream* stream = other.back();
+        other.pop_back();
+        p.steals++;
+        return stream;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // The mutex needs to be held.
+  void post(PoolState& p, napi_env env, Completion* completion) {
+    auto it = p.envs.find(env);
+    if (it == p.envs.end() ||
+        napi_call_threadsafe_function(it->second.tsfn, completion, napi_tsfn_nonblocking) != napi_ok) {
+      // Tasks are leaked in this case, see CodingThreadPool::Post().
+      delete completion;
+    }
+  }
+
+  // The mutex needs to be held; it is released while the task runs.
+  void runTask(PoolState& p, std::unique_lock<std::mutex>& lock) {
+    QueuedTask queued = p.queuedTasks.front();
+    p.queuedTasks.pop_front();
+    p.tasks++;
+
+    lock.unlock();
+    queued.task->Execute();
+    lock.lock();
+
+    post(p, queued.env, new Completion { nullptr, 0, true, queued.task });
+  }
+
+  void workerMain(size_t self) {
+    Tracer::SetThreadName("lzma coding thread");
+
+    PoolState& p = pool();
+    std::unique_lock<std::mutex> lock(p.mutex);
+
+    while (self < p.targetThreads) {
+      LZMAStream* stream = takeStream(p, self, CodingThreadPool::PRIORITY_LATENCY);
+
+      if (stream == nullptr && !p.queuedTasks.empty()) {
+        runTask(p, lock);
+        continue;
+      }
+
+      if (stream == nullptr)
+        stream = takeStream(p, self, CodingThreadPool::PRIORITY_BULK);
+
+      if (stream == nullptr) {
+        p.workAvailable.wait(lock);
+        continue;
+      }
+
+      StreamState& state = p.streams[stream];
+      state.queued = false;
+      state.running = true;
+      p.tasks++;
+
+      uint64_t quantumBytes = p.quantumBytes;
+      uint64_t quantumNanos = p.quantumNanos;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      uint64_t queuedNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now - state.queuedAt).count();
+
+      if (Tracer::Enabled()) {
+        Tracer::Record("queued", stream->traceId, Tracer::Nanos(state.queuedAt),
+                       Tracer::Nanos(now), true);
+      }
+
+      lock.unlock();
+      bool yielded = stream->doLZMACodeFromAsync(quantumBytes, quantumNanos, queuedNanos);
+      lock.lock();
+
+      // The entry cannot have gone away, since CodingThreadPool::Forget()
+      // waits for running streams.
+      StreamState& after = p.streams[stream];
+      after.running = false;
+
+      if (yielded)
+        p.yields++;
+
+      // Streams that used up their quantum go to the back of the queue, so
+      // that everything queued in the meantime gets its turn first.
+      bool idle = !after.rerun && !yielded;
+      if (!idle) {
+        after.rerun = false;
+        after.queued = true;
+        after.queuedAt = std::chrono::steady_clock::now();
+        p.workers[self]->queues[after.priority].push_back(stream);
+      }
+
+      post(p, after.env, new Completion { stream, after.id, idle, nullptr });
+      p.streamIdle.notify_all();
+    }
+
+    // Hand remaining work over to the threads that are still running.
+    for (int prio = 0; prio < kPriorities; prio++) {
+      std::deque<LZMAStream*>& own = p.workers[self]->queues[prio];
+      std::deque<LZMAStream*>& first = p.workers[0]->queues[prio];
+      first.insert(first.end(), own.begin(), own.end());
+      own.clear();
+    }
+
+    p.workers[self]->alive = false;
+    p.workAvailable.notify_all();
+  }
+
+  // The mutex needs to be held.
+  void startThreads(PoolState& p) {
+    if (p.targetThreads == 0)
+      p.targetThreads = defaultThreads();
+
+    while (p.workers.size() < p.targetThreads)
+      p.workers.emplace_back(new Worker());
+
+    for (size_t i = 0; i < p.targetThreads; i++) {
+      if (p.workers[i]->alive)
+        continue;
+
+      p.workers[i]->alive = true;
+      std::thread(workerMain, i).detach();
+    }
+  }
+
+  // Lets the event loop exit once there is no work left for env.
+  void releasePending(PoolState& p, napi_env env) {
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    auto it = p.envs.find(env);
+    if (it != p.envs.end() && --it->second.pending == 0)
+      napi_unref_threadsafe_function(env, it->second.tsfn);
+  }
+
+  extern "C" void callJS(napi_env env, napi_value jsCallback, void* context, void* data) {
+    Completion* completion = static_cast<Completion*>(data);
+    std::unique_ptr<Completion> owned(completion);
+
+    // The environment is going away. Tasks are leaked in this case.
+    if (env == nullptr)
+      return;
+
+    PoolState& p = pool();
+
+    if (completion->task != nullptr) {
+      std::unique_ptr<CodingThreadPool::Task> task(completion->task);
+      releasePending(p, env);
+
+      try {
+        task->OnComplete(Napi::Env(env));
+      } catch (const Error& e) {
+        e.ThrowAsJavaScriptException();
+      }
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(p.mutex);
+
+      auto it = p.streams.find(completion->stream);
+      if (it == p.streams.end() || it->second.id != completion->id)
+        return;
+    }
+
+    LZMAStream* stream = completion->stream;
+
+    try {
+      stream->invokeBufferHandlers(false);
+    } catch (const Error& e) {
+      e.ThrowAsJavaScriptException();
+    }
+
+    if (!completion->idle)
+      return;
+
+    releasePending(p, env);
+
+    // Matches the Ref() in CodingThreadPool::Schedule(). The stream may be
+    // garbage collected after this.
+    stream->Unref();
+  }
+
+  void releaseEnv(void* arg) {
+    napi_env env = static_cast<napi_env>(arg);
+    PoolState& p = pool();
+    napi_threadsafe_function tsfn;
+
+    {
+      std::lock_guard<std::mutex> lock(p.mutex);
+
+      auto it = p.envs.find(env);
+      if (it == p.envs.end())
+        return;
+
+      tsfn = it->second.tsfn;
+      p.envs.erase(it);
+    }
+
+    napi_release_threadsafe_function(tsfn, napi_tsfn_abort);
+  }
+
+  // The mutex needs to be held.
+  EnvState* envState(PoolState& p, napi_env env) {
+    auto it = p.envs.find(env);
+    if (it != p.envs.end())
+      return &it->second;
+
+    napi_value name;
+    napi_threadsafe_function tsfn;
+
+    if (napi_create_string_utf8(env, "LZMACodingThreadPool", NAPI_AUTO_LENGTH, &name) != napi_ok ||
+        napi_create_threadsafe_function(env, nullptr, nullptr, name, 0, 1,
+                                        nullptr, nullptr, nullptr, callJS, &tsfn) != napi_ok) {
+      return nullptr;
+    }
+
+    // Only keep the event loop alive while there is work in progress.
+    napi_unref_threadsafe_function(env, tsfn);
+    napi_add_env_cleanup_hook(env, releaseEnv, env);
+
+    EnvState& state = p.envs[env];
+    state.tsfn = tsfn;
+    state.pending = 0;
+    return &state;
+  }
+}
+
+void CodingThreadPool::Schedule(LZMAStream* stream, Priority priority) {
+  napi_env env = stream->Env();
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  auto it = p.streams.find(stream);
+  if (it == p.streams.end()) {
+    StreamState state(env, ++p.nextId, priority);
+    it = p.streams.insert(std::make_pair(stream, state)).first;
+  }
+
+  StreamState& state = it->second;
+  state.priority = priority;
+
+  // Whoever runs next picks up all input that has been queued until then.
+  if (state.queued || state.rerun)
+    return;
+
+  if (state.running) {
+    state.rerun = true;
+    return;
+  }
+
+  EnvState* envs = envState(p, env);
+  if (envs == nullptr)
+    throw Error::New(env, "Could not set up the coding thread pool");
+
+  if (envs->pending++ == 0)
+    napi_ref_threadsafe_function(env, envs->tsfn);
+  stream->Ref();
+
+  startThreads(p);
+
+  state.queued = true;
+  state.queuedAt = std::chrono::steady_clock::now();
+  p.workers[p.nextWorker++ % p.targetThreads]->queues[priority].push_back(stream);
+  p.workAvailable.notify_one();
+}
+
+void CodingThreadPool::Post(napi_env env, Task* task) {
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  EnvState* envs = envState(p, env);
+  if (envs == nullptr) {
+    delete task;
+    throw Error::New(env, "Could not set up the coding thread pool");
+  }
+
+  if (envs->pending++ == 0)
+    napi_ref_threadsafe_function(env, envs->tsfn);
+
+  startThreads(p);
+
+  p.queuedTasks.push_back(QueuedTask { env, task });
+  p.workAvailable.notify_one();
+}
+
+void CodingThreadPool::Forget(LZMAStream* stream) {
+  PoolState& p = pool();
+  std::unique_lock<std::mutex> lock(p.mutex);
+
+  auto it = p.streams.find(stream);
+  if (it == p.streams.end())
+    return;
+
+  while (p.streams[stream].running)
+    p.streamIdle.wait(lock);
+
+  for (auto& worker : p.workers) {
+    for (int prio = 0; prio < kPriorities; prio++) {
+      std::deque<LZMAStream*>& queue = worker->queues[prio];
+      queue.erase(std::remove(queue.begin(), queue.end(), stream), queue.end());
+    }
+  }
+
+  p.streams.erase(stream);
+}
+
+Napi::Value CodingThreadPool::SetThreads(const CallbackInfo& info) {
+  if (!info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 1)
+    throw TypeError::New(info.Env(), "setCodingThreads() needs a positive numerical argument");
+
+  size_t threads = static_cast<size_t>(info[0].As<Number>().Int64Value());
+  size_t oldThreads;
+
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  oldThreads = p.targetThreads == 0 ? defaultThreads() : p.targetThreads;
+  p.targetThreads = threads;
+
+  // Threads beyond the new size exit once they are done with their current
+  // task. New threads are started when work arrives.
+  p.workAvailable.notify_all();
+
+  return Number::New(info.Env(), static_cast<double>(oldThreads));
+}
+
+Napi::Value CodingThreadPool::SetQuantum(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+
+  if (!info[0].IsObject())
+    throw TypeError::New(env, "setCodingQuantum() needs an options object");
+
+  Object options = info[0].As<Object>();
+  Napi::Value bytes = options["bytes"];
+  Napi::Value ms = options["ms"];
+
+  if ((!bytes.IsUndefined() && (!bytes.IsNumber() || bytes.As<Number>().DoubleValue() < 0)) ||
+      (!ms.IsUndefined() && (!ms.IsNumber() || ms.As<Number>().DoubleValue() < 0))) {
+    throw TypeError::New(env, "Work quanta need to be non-negative numbers");
+  }
+
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  Object previous = Object::New(env);
+  previous["bytes"] = Number::New(env, static_cast<double>(p.quantumBytes));
+  previous["ms"] = Number::New(env, p.quantumNanos / 1e6);
+
+  // Takes effect with the next coding step of each stream.
+  if (!bytes.IsUndefined())
+    p.quantumBytes = static_cast<uint64_t>(bytes.As<Number>().DoubleValue());
+  if (!ms.IsUndefined())
+    p.quantumNanos = static_cast<uint64_t>(ms.As<Number>().DoubleValue() * 1e6);
+
+  return previous;
+}
+
+Napi::Value CodingThreadPool::GetStats(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  size_t running = 0, queued[kPriorities] = { 0, 0 };
+  for (const auto& worker : p.workers) {
+    running += worker->alive ? 1 : 0;
+    for (int prio = 0; prio < kPriorities; prio++)
+      queued[prio] += worker->queues[prio].size();
+  }
+
+  Object obj = Object::New(env);
+  obj["threads"] = Number::New(env, static_cast<double>(
+      p.targetThreads == 0 ? defaultThreads() : p.targetThreads));
+  obj["runningThreads"] = Number::New(env, static_cast<double>(running));
+  obj["queuedLatency"] = Number::New(env, static_cast<double>(queued[PRIORITY_LATENCY]));
+  obj["queuedBulk"] = Number::New(env, static_cast<double>(queued[PRIORITY_BULK]));
+  obj["tasks"] = Number::New(env, static_cast<double>(p.tasks));
+  obj["steals"] = Number::New(env, static_cast<double>(p.steals));
+  obj["yields"] = Number::New(env, static_cast<double>(p.yields));
+  obj["quantumBytes"] = Number::New(env, static_cast<double>(p.quantumBytes));
+  obj["quantumMs"] = Number::New(env, p.quantumNanos / 1e6);
+
+  return obj;
+}
+
+}
@@ -0,0 +1,343 @@
+#include "liblzma-node.hpp"
+#include <cstring>
+#include <atomic>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define LZMA_NODE_CRC_CLMUL 1
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CLMUL_TARGET
+#else
+#include <cpuid.h>
+#define CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+#endif
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__clang__) || \
+    (defined(__GNUC__) && __GNUC__ >= 9)) && (defined(__linux__) || defined(__APPLE__))
+#define LZMA_NODE_CRC_PMULL 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#ifdef __clang__
+#define PMULL_TARGET __attribute__((target("crypto")))
+#else
+#define PMULL_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+namespace lzma {
+
+/*
+ * The kernels fold the input 16 bytes at a time: for a 128-bit chunk A
+ * that is followed by D more bits of input, A * x^D is congruent to a
+ * polynomial of at most 128 bits modulo the CRC polynomial, which can be
+ * computed with two carry-less multiplications of its 64-bit halves with
+ * precomputed constants. Once less than 16 bytes are left, the remaining
+ * 16-byte chunk and the tail are handed to liblzma, so the results are the
+ * same as those of lzma_crc32()/lzma_crc64() by construction.
+ *
+ * All values are bit-reflected, like the CRCs themselves. Multiplying two
+ * reflected 64-bit values yields the reflected product times x, which is
+ * why the constants are x^(D-1) and x^(D+63) rather than x^D and x^(D+64).
+ */
+
+namespace {
+  typedef uint32_t (*CRC32Fn)(const uint8_t* buf, size_t size, uint32_t crc);
+  typedef uint64_t (*CRC64Fn)(const uint8_t* buf, size_t size, uint64_t crc);
+
+  // Shorter input is not worth setting up the folding for.
+  const size_t kMinFoldSize = 64;
+
+  struct FoldConstants {
+    // For folding by 512 bits (four chunks in parallel) and by 128 bits.
+    uint64_t fold512[2];
+    uint64_t fold128[2];
+  };
+
+  // x^n modulo the polynomial of the given width (32 or 64), whose
+  // non-reflected form without the x^width term is poly. Bit-reflected as
+  // a 64-bit value.
+  uint64_t reflectedPowerMod(unsigned n, uint64_t poly, unsigned width) {
+    uint64_t top = uint64_t(1) << (width - 1);
+    uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+    uint64_t r = 1;
+
+    for (unsigned i = 0; i < n; i++) {
+      bool carry = (r & top) != 0;
+      r = (r << 1) & mask;
+      if (carry)
+        r ^= poly;
+    }
+
+    uint64_t reflected = 0;
+    for (unsigned i = 0; i < 64; i++) {
+      if (r & (uint64_t(1) << i))
+        reflected |= uint64_t(1) << (63 - i);
+    }
+
+    return reflected;
+  }
+
+  FoldConstants makeConstants(uint64_t poly, unsigned width) {
+    FoldConstants c;
+    c.fold512[0] = reflectedPowerMod(512 + 63, poly, width);
+    c.fold512[1] = reflectedPowerMod(512 - 1, poly, width);
+    c.fold128[0] = reflectedPowerMod(128 + 63, poly, width);
+    c.fold128[1] = reflectedPowerMod(128 - 1, poly, width);
+    return c;
+  }
+
+  const FoldConstants& crc32Constants() {
+    static const FoldConstants constants = makeConstants(0x04C11DB7, 32);
+    return constants;
+  }
+
+  const FoldConstants& crc64Constants() {
+    static const FoldConstants constants = makeConstants(0x42F0E1EBA9EA3693ULL, 64);
+    return constants;
+  }
+
+  // The initial CRC register value is folded into the first input bytes.
+  void initialBlock(uint8_t* block, const uint8_t* buf, uint64_t reg, size_t regBytes) {
+    memcpy(block, buf, 16);
+    for (size_t i = 0; i < regBytes; i++)
+      block[i] ^= static_cast<uint8_t>(reg >> (8 * i));
+  }
+
+#ifdef LZMA_NODE_CRC_CLMUL
+  CLMUL_TARGET inline __m128i foldClmul(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+  }
+
+  // Fold all but the last 0-15 bytes of buf (which is at least
+  // kMinFoldSize long) into a single 16-byte chunk, stored in out.
+  CLMUL_TARGET void foldWithClmul(const uint8_t* buf, size_t size, uint64_t reg,
+                                  size_t regBytes, const FoldConstants& c, uint8_t* out) {
+    uint8_t first[16];
+    initialBlock(first, buf, reg, regBytes);
+
+    __m128i k512 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c.fold512));
+    __m128i k128 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c.fold128));
+
+    __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48));
+    buf += 64;
+    size -= 64;
+
+    for (; size >= 64; buf += 64, size -= 64) {
+      x0 = _mm_xor_si128(foldClmul(x0, k512), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)));
+      x1 = _mm_xor_si128(foldClmul(x1, k512), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16)));
+      x2 = _mm_xor_si128(foldClmul(x2, k512), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32)));
+      x3 = _mm_xor_si128(foldClmul(x3, k512), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48)));
+    }
+
+    __m128i x = _mm_xor_si128(foldClmul(x0, k128), x1);
+    x = _mm_xor_si128(foldClmul(x, k128), x2);
+    x = _mm_xor_si128(foldClmul(x, k128), x3);
+
+    for (; size >= 16; buf += 16, size -= 16)
+      x = _mm_xor_si128(foldClmul(x, k128), _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), x);
+  }
+
+  uint32_t crc32Clmul(const uint8_t* buf, size_t size, uint32_t crc) {
+    if (size < kMinFoldSize)
+      return lzma_crc32(buf, size, crc);
+
+    uint8_t rest[32];
+    foldWithClmul(buf, size, ~crc, 4, crc32Constants(), rest);
+
+    size_t tail = size % 16;
+    memcpy(rest + 16, buf + size - tail, tail);
+    return lzma_crc32(rest, 16 + tail, 0xFFFFFFFF);
+  }
+
+  uint64_t crc64Clmul(const uint8_t* buf, size_t size, uint64_t crc) {
+    if (size < kMinFoldSize)
+      return lzma_crc64(buf, size, crc);
+
+    uint8_t rest[32];
+    foldWithClmul(buf, size, ~crc, 8, crc64Constants(), rest);
+
+    size_t tail = size % 16;
+    memcpy(rest + 16, buf + size - tail, tail);
+    return lzma_crc64(rest, 16 + tail, ~uint64_t(0));
+  }
+
+  bool haveClmul() {
+    unsigned int ecx, edx;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    ecx = static_cast<unsigned int>(info[2]);
+    edx = static_cast<unsigned int>(info[3]);
+#else
+    unsigned int eax, ebx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+      return false;
+#endif
+    // PCLMULQDQ and SSE2
+    return (ecx & (1 << 1)) != 0 && (edx & (1 << 26)) != 0;
+  }
+#endif
+
+#ifdef LZMA_NODE_CRC_PMULL
+  PMULL_TARGET inline uint64x2_t foldPmull(uint64x2_t x, uint64x2_t k) {
+    poly128_t lo = vmull_p64(vgetq_lane_u64(x, 0), vgetq_lane_u64(k, 0));
+    poly128_t hi = vmull_p64(vgetq_lane_u64(x, 1), vgetq_lane_u64(k, 1));
+    return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+  }
+
+  PMULL_TARGET inline uint64x2_t load(const uint8_t* p) {
+    return vreinterpretq_u64_u8(vld1q_u8(p));
+  }
+
+  PMULL_TARGET void foldWithPmull(const uint8_t* buf, size_t size, uint64_t reg,
+                                  size_t regBytes, const FoldConstants& c, uint8_t* out) {
+    uint8_t first[16];
+    initialBlock(first, buf, reg, regBytes);
+
+    uint64x2_t k512 = vld1q_u64(c.fold512);
+    uint64x2_t k128 = vld1q_u64(c.fold128);
+
+    uint64x2_t x0 = load(first);
+    uint64x2_t x1 = load(buf + 16);
+    uint64x2_t x2 = load(buf + 32);
+    uint64x2_t x3 = load(buf + 48);
+    buf += 64;
+    size -= 64;
+
+    for (; size >= 64; buf += 64, size -= 64) {
+      x0 = veorq_u64(foldPmull(x0, k512), load(buf));
+      x1 = veorq_u64(foldPmull(x1, k512), load(buf + 16));
+      x2 = veorq_u64(foldPmull(x2, k512), load(buf + 32));
+      x3 = veorq_u64(foldPmull(x3, k512), load(buf + 48));
+    }
+
+    uint64x2_t x = veorq_u64(foldPmull(x0, k128), x1);
+    x = veorq_u64(foldPmull(x, k128), x2);
+    x = veorq_u64(foldPmull(x, k128), x3);
+
+    for (; size >= 16; buf += 16, size -= 16)
+      x = veorq_u64(foldPmull(x, k128), load(buf));
+
+    vst1q_u8(out, vreinterpretq_u8_u64(x));
+  }
+
+  uint32_t crc32Pmull(const uint8_t* buf, size_t size, uint32_t crc) {
+    if (size < kMinFoldSize)
+      return lzma_crc32(buf, size, crc);
+
+    uint8_t rest[32];
+    foldWithPmull(buf, size, ~crc, 4, crc32Constants(), rest);
+
+    size_t tail = size % 16;
+    memcpy(rest + 16, buf + size - tail, tail);
+    return lzma_crc32(rest, 16 + tail, 0xFFFFFFFF);
+  }
+
+  uint64_t crc64Pmull(const uint8_t* buf, size_t size, uint64_t crc) {
+    if (size < kMinFoldSize)
+      return lzma_crc64(buf, size, crc);
+
+    uint8_t rest[32];
+    foldWithPmull(buf, size, ~crc, 8, crc64Constants(), rest);
+
+    size_t tail = size % 16;
+    memcpy(rest + 16, buf + size - tail, tail);
+    return lzma_crc64(rest, 16 + tail, ~uint64_t(0));
+  }
+
+  bool havePmull() {
+#ifdef __APPLE__
+    return true;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#endif
+  }
+#endif
+
+  struct Kernel {
+    const char* name;
+    CRC32Fn crc32;
+    CRC64Fn crc64;
+    bool (*available)();
+  };
+
+  bool always() {
+    return true;
+  }
+
+  // In order of preference.
+  const Kernel kKernels[] = {
+#ifdef LZMA_NODE_CRC_CLMUL
+    { "clmul", crc32Clmul, crc64Clmul, haveClmul },
+#endif
+#ifdef LZMA_NODE_CRC_PMULL
+    { "pmull", crc32Pmull, crc64Pmull, havePmull },
+#endif
+    { "table", lzma_crc32, lzma_crc64, always }
+  };
+
+  const Kernel* bestKernel() {
+    for (const Kernel& kernel : kKernels) {
+      if (kernel.available())
+        return &kernel;
+    }
+
+    return nullptr;
+  }
+
+  std::atomic<const Kernel*>& currentKernel() {
+    static std::atomic<const Kernel*>* kernel = new std::atomic<const Kernel*>(bestKernel());
+    return *kernel;
+  }
+}
+
+void CRC::InitializeExports(Object exports) {
+  Napi::Env env = exports.Env();
+
+  // Pick the kernel now rather than on first use.
+  currentKernel();
+
+  exports["crcKernel"] = Function::New(env, CRC::GetKernel);
+  exports["setCRCKernel"] = Function::New(env, CRC::SetKernel);
+}
+
+uint32_t CRC::CRC32(const uint8_t* buf, size_t size, uint32_t crc) {
+  return currentKernel().load(std::memory_order_relaxed)->crc32(buf, size, crc);
+}
+
+uint64_t CRC::CRC64(const uint8_t* buf, size_t size, uint64_t crc) {
+  return currentKernel().load(std::memory_order_relaxed)->crc64(buf, size, crc);
+}
+
+Napi::Value CRC::GetKernel(const CallbackInfo& info) {
+  return String::New(info.Env(), currentKernel().load()->name);
+}
+
+Napi::Value CRC::SetKernel(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  std::string name = info[0].ToString();
+
+  for (const Kernel& kernel : kKernels) {
+    if (name == kernel.name && kernel.available()) {
+      const Kernel* previous = currentKernel().exchange(&kernel);
+      return String::New(env, previous->name);
+    }
+  }
+
+  throw Error::New(env, "CRC kernel '" + name + "' is not available on this CPU");
+}
+
+}
@@ -0,0 +1,325 @@
+#include "liblzma-node.hpp"
+#include <uv.h>
+#include <cstring>
+#include <algorithm>
+
+namespace lzma {
+
+namespace {
+  // Amount of a file descriptor that is read at a time.
+  const size_t kFDReadSize = 1 << 20;
+
+  // liblzma implements SHA-256 for the integrity checks of .xz files, but
+  // does not export it, so this is a plain implementation of FIPS 180-4.
+  const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+  inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  void sha256Transform(uint32_t* state, const uint8_t* block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+      w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) |
+             (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+             (static_cast<uint32_t>(block[4 * i + 2]) << 8) |
+             static_cast<uint32_t>(block[4 * i + 3]);
+    }
+
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                    ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+
+  class HashBufferWorker : public AsyncWorker {
+    public:
+      HashBufferWorker(Function callback, Hasher* hasher, Object input,
+                       const uint8_t* data, size_t length)
+        : AsyncWorker(callback, "HashBufferWorker"),
+          hasher(hasher),
+          data(data),
+          length(length) {
+        // Keeps the hasher and the input alive while they are being used on
+        // the worker thread.
+        Receiver().Set(static_cast<uint32_t>(0), hasher->Value());
+        Receiver().Set(static_cast<uint32_t>(1), input);
+      }
+
+      void Execute() override {
+        hasher->update(data, length);
+      }
+
+    private:
+      void OnOK() override {
+        hasher->busy = false;
+        Callback().Call({ Env().Null() });
+      }
+
+      Hasher* hasher;
+      const uint8_t* data;
+      size_t length;
+  };
+
+  class HashFDWorker : public AsyncWorker {
+    public:
+      HashFDWorker(Function callback, Hasher* hasher, int fd,
+                   uint64_t offset, uint64_t length)
+        : AsyncWorker(callback, "HashFDWorker"),
+          hasher(hasher),
+          fd(fd),
+          offset(offset),
+          length(length),
+          hashed(0),
+          error(0) {
+        Receiver().Set(static_cast<uint32_t>(0), hasher->Value());
+      }
+
+      void Execute() override {
+        error = hasher->updateFromFD(fd, offset, length, &hashed);
+      }
+
+    private:
+      void OnOK() override {
+        Napi::Env env = Env();
+        hasher->busy = false;
+
+        if (error != 0) {
+          Error err = Error::New(env, uv_strerror(error));
+          err.Value()["code"] = String::New(env, uv_err_name(error));
+          Callback().Call({ err.Value(), env.Null() });
+          return;
+        }
+
+        Callback().Call({ env.Null(), Uint64ToNumberMaxNull(env, hashed) });
+      }
+
+      Hasher* hasher;
+      int fd;
+      uint64_t offset;
+      uint64_t length;
+      uint64_t hashed;
+      int error;
+  };
+}
+
+Hasher::Hasher(const CallbackInfo& info) :
+  ObjectWrap(info),
+  busy(false),
+  check(static_cast<lzma_check>(info[0].ToNumber().Int32Value())),
+  crc32(0),
+  crc64(0)
+{
+  if (check != LZMA_CHECK_CRC32 && check != LZMA_CHECK_CRC64 && check != LZMA_CHECK_SHA256)
+    throw lzmaRetError(info.Env(), LZMA_UNSUPPORTED_CHECK);
+
+  sha256Init(&sha256);
+}
+
+void Hasher::InitializeExports(Object exports) {
+  exports["Hasher"] = DefineClass(exports.Env(), "Hasher", {
+    InstanceMethod("update", &Hasher::Update),
+    InstanceMethod("updateAsync", &Hasher::UpdateAsync),
+    InstanceMethod("updateFD", &Hasher::UpdateFD),
+    InstanceMethod("digest", &Hasher::Digest),
+  });
+}
+
+void Hasher::update(const uint8_t* data, size_t length) {
+  switch (check) {
+    case LZMA_CHECK_CRC32:
+      crc32 = CRC::CRC32(data, length, crc32);
+      break;
+    case LZMA_CHECK_CRC64:
+      crc64 = CRC::CRC64(data, length, crc64);
+      break;
+    default:
+      sha256Update(&sha256, data, length);
+      break;
+  }
+}
+
+int Hasher::updateFromFD(int fd, uint64_t offset, uint64_t length, uint64_t* hashed) {
+  std::vector<uint8_t> buf(static_cast<size_t>(std::min<uint64_t>(kFDReadSize, length)));
+  *hashed = 0;
+
+  while (*hashed < length) {
+    uv_fs_t req;
+    uv_buf_t uvbuf = uv_buf_init(reinterpret_cast<char*>(buf.data()),
+        static_cast<unsigned int>(std::min<uint64_t>(buf.size(), length - *hashed)));
+
+    // Without a loop and a callback, this reads synchronously.
+    int r = uv_fs_read(nullptr, &req, fd, &uvbuf, 1, offset + *hashed, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (r < 0)
+      return r;
+    if (r == 0)
+      break;
+
+    update(buf.data(), r);
+    *hashed += r;
+  }
+
+  return 0;
+}
+
+void Hasher::sha256Init(Sha256* sha) {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(sha->state, initial, sizeof(initial));
+  sha->length = 0;
+}
+
+void Hasher::sha256Update(Sha256* sha, const uint8_t* data, size_t length) {
+  if (length == 0)
+    return;
+
+  size_t used = static_cast<size_t>(sha->length % 64);
+  sha->length += length;
+
+  if (used > 0) {
+    size_t n = std::min<size_t>(64 - used, length);
+    memcpy(sha->block + used, data, n);
+    data += n;
+    length -= n;
+
+    if (used + n < 64)
+      return;
+
+    sha256Transform(sha->state, sha->block);
+  }
+
+  // Full blocks are hashed straight from the input.
+  for (; length >= 64; data += 64, length -= 64)
+    sha256Transform(sha->state, data);
+
+  memcpy(sha->block, data, length);
+}
+
+// Takes a copy, so that more data can be added after the digest was taken.
+void Hasher::sha256Finish(Sha256 sha, uint8_t* digest) {
+  uint64_t bits = sha.length * 8;
+  uint8_t padding[72] = { 0x80 };
+  size_t used = static_cast<size_t>(sha.length % 64);
+  size_t padLength = (used < 56 ? 56 : 120) - used;
+
+  for (int i = 0; i < 8; i++)
+    padding[padLength + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+
+  sha256Update(&sha, padding, padLength + 8);
+
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i] = static_cast<uint8_t>(sha.state[i] >> 24);
+    digest[4 * i + 1] = static_cast<uint8_t>(sha.state[i] >> 16);
+    digest[4 * i + 2] = static_cast<uint8_t>(sha.state[i] >> 8);
+    digest[4 * i + 3] = static_cast<uint8_t>(sha.state[i]);
+  }
+}
+
+void Hasher::checkIdle() {
+  if (busy)
+    throw Error::New(Env(), "Hasher is busy with an asynchronous update");
+}
+
+Napi::Value Hasher::Update(const CallbackInfo& info) {
+  checkIdle();
+
+  const uint8_t* data;
+  size_t length;
+  readBufferPointerFromObj(info[0], &data, &length);
+
+  update(data, length);
+  return info.This();
+}
+
+Napi::Value Hasher::UpdateAsync(const CallbackInfo& info) {
+  checkIdle();
+
+  const uint8_t* data;
+  size_t length;
+  readBufferPointerFromObj(info[0], &data, &length);
+
+  HashBufferWorker* worker = new HashBufferWorker(
+      info[1].As<Function>(), this, info[0].As<Object>(), data, length);
+  busy = true;
+  worker->Queue();
+
+  return Env().Undefined();
+}
+
+Napi::Value Hasher::UpdateFD(const CallbackInfo& info) {
+  checkIdle();
+
+  int fd = info[0].ToNumber().Int32Value();
+  uint64_t offset = static_cast<uint64_t>(info[1].ToNumber().Int64Value());
+  uint64_t length = NumberToUint64ClampNullMax(info[2]);
+
+  HashFDWorker* worker = new HashFDWorker(info[3].As<Function>(), this, fd, offset, length);
+  busy = true;
+  worker->Queue();
+
+  return Env().Undefined();
+}
+
+// The digest is stored the way it appears in .xz files, i.e. CRCs are
+// little-endian.
+Napi::Value Hasher::Digest(const CallbackInfo& info) {
+  checkIdle();
+
+  uint8_t digest[32];
+  size_t size = lzma_check_size(check);
+
+  switch (check) {
+    case LZMA_CHECK_CRC32:
+      for (int i = 0; i < 4; i++)
+        digest[i] = static_cast<uint8_t>(crc32 >> (8 * i));
+      break;
+    case LZMA_CHECK_CRC64:
+      for (int i = 0; i < 8; i++)
+        digest[i] = static_cast<uint8_t>(crc64 >> (8 * i));
+      break;
+    default:
+      sha256Finish(sha256, digest);
+      break;
+  }
+
+  return Buffer<uint8_t>::Copy(Env(), digest, size);
+}
+
+}
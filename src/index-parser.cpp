@@ -427,6 +427,8 @@ error:
 }
 
 #include "liblzma-node.hpp"
+#include <uv.h>
+#include <algorithm>
 
 namespace lzma {
 
@@ -435,7 +437,11 @@ void IndexParser::InitializeExports(Object exports) {
     InstanceMethod("init", &IndexParser::Init),
     InstanceMethod("feed", &IndexParser::Feed),
     InstanceMethod("parse", &IndexParser::Parse),
+    InstanceMethod("parseFD", &IndexParser::ParseFD),
+    InstanceMethod("blockTable", &IndexParser::BlockTable),
   });
+
+  exports["locateBlock_"] = Function::New(exports.Env(), IndexParser::LocateBlock);
 }
 
 namespace {
@@ -455,7 +461,7 @@ namespace {
       return result;
 
     *result = nBytes;
-    MemoryManagement::AdjustExternalMemory(p->Env(), static_cast<int64_t>(nBytes));
+    p->adjustExternalMemory(static_cast<int64_t>(nBytes));
     return static_cast<void*>(result + 1);
   }
 
@@ -467,12 +473,55 @@ namespace {
 
     size_t* orig = static_cast<size_t*>(ptr) - 1;
 
-    MemoryManagement::AdjustExternalMemory(p->Env(), -static_cast<int64_t>(*orig));
+    p->adjustExternalMemory(-static_cast<int64_t>(*orig));
     return ::free(static_cast<void*>(orig));
   }
+
+  extern "C" int64_t LZMA_API_CALL
+  read_fd_cb(void* opaque, uint8_t* buf, size_t count, int64_t offset) {
+    IndexParser* p = static_cast<IndexParser*>(opaque);
+    return p->readFromFD(buf, count, offset);
+  }
+
+  // How much of the file to read at once when parsing from a file
+  // descriptor. Stream footers, indexes and the preceding stream's end
+  // usually all fit into one window.
+  const uint64_t kIndexReadWindow = 1 << 20;
+
+  class IndexParseWorker : public AsyncWorker {
+    public:
+      IndexParseWorker(Function callback, IndexParser* parser)
+        : AsyncWorker(callback, "IndexParseWorker"),
+          parser(parser),
+          ret(LZMA_PROG_ERROR) {
+        // Keeps the parser alive while it is being used on the worker thread.
+        Receiver().Set(static_cast<uint32_t>(0), parser->Value());
+      }
+
+      void Execute() override {
+        ret = parser->parseFromFD();
+      }
+
+    private:
+      void OnOK() override {
+        parser->finishParseFromFD(Callback().Value(), ret);
+      }
+
+      IndexParser* parser;
+      lzma_ret ret;
+  };
+}
+
+void IndexParser::adjustExternalMemory(int64_t bytesChange) {
+  if (detached)
+    nonAdjustedExternalMemory += bytesChange;
+  else
+    MemoryManagement::AdjustExternalMemory(Env(), bytesChange);
 }
 
 int64_t IndexParser::readCallback(void* opaque, uint8_t* buf, size_t count, int64_t offset) {
+  Tracer::Span span("index read_cb", traceId);
+
   currentReadBuffer = buf;
   currentReadSize = count;
 
@@ -496,7 +545,15 @@ int64_t IndexParser::readCallback(void* opaque, uint8_t* buf, size_t count, int6
 
 IndexParser::IndexParser(const CallbackInfo& args)
   : ObjectWrap(args),
-    isCurrentlyInParseCall(false) {
+    isCurrentlyInParseCall(false),
+    fd(-1),
+    ioError(0),
+    windowOffset(0),
+    lastReadEnd(0),
+    fromSidecar(false),
+    detached(false),
+    nonAdjustedExternalMemory(0),
+    traceId(Tracer::NextId()) {
   lzma_index_parser_data info_ = LZMA_INDEX_PARSER_DATA_INIT;
   info = info_;
 
@@ -514,6 +571,141 @@ void IndexParser::Init(const CallbackInfo& args) {
   info.memlimit = NumberToUint64ClampNullMax(args[1]);
 }
 
+int64_t IndexParser::readFromFD(uint8_t* buf, size_t count, int64_t offset) {
+  Tracer::Span span("index read", traceId);
+
+  uint64_t start = static_cast<uint64_t>(offset);
+  uint64_t end = start + count;
+
+  if (start < windowOffset || end > windowOffset + window.size()) {
+    // The parser mostly moves backwards through the file, except for the
+    // index itself, which is read front to back.
+    uint64_t size = std::max<uint64_t>(count, kIndexReadWindow);
+    uint64_t windowStart = start == lastReadEnd ? start : (end > size ? end - size : 0);
+    uint64_t windowEnd = std::min<uint64_t>(windowStart + size, info.file_size);
+
+    window.resize(windowEnd > windowStart ? windowEnd - windowStart : 0);
+    windowOffset = windowStart;
+
+    size_t done = 0;
+    while (done < window.size()) {
+      uv_fs_t req;
+      uv_buf_t uvbuf = uv_buf_init(reinterpret_cast<char*>(window.data() + done),
+          static_cast<unsigned int>(std::min<size_t>(window.size() - done, 1 << 30)));
+
+      // Without a loop and a callback, this reads synchronously.
+      int r = uv_fs_read(nullptr, &req, fd, &uvbuf, 1, windowStart + done, nullptr);
+      uv_fs_req_cleanup(&req);
+
+      if (r < 0) {
+        ioError = r;
+        window.clear();
+        return -1;
+      }
+
+      if (r == 0)
+        break;
+
+      done += r;
+    }
+
+    window.resize(done);
+  }
+
+  lastReadEnd = end;
+
+  uint64_t windowEnd = windowOffset + window.size();
+  size_t available = start < windowEnd ? std::min<uint64_t>(count, windowEnd - start) : 0;
+
+  if (available > 0)
+    memcpy(buf, window.data() + (start - windowOffset), available);
+  return available;
+}
+
+lzma_ret IndexParser::parseFromFD() {
+  IndexSidecar::FileStamp stamp;
+  uv_fs_t req;
+  int r = uv_fs_fstat(nullptr, &req, fd, nullptr);
+  if (r == 0) {
+    stamp.size = req.statbuf.st_size;
+    stamp.mtimeSec = req.statbuf.st_mtim.tv_sec;
+    stamp.mtimeNsec = static_cast<uint32_t>(req.statbuf.st_mtim.tv_nsec);
+  }
+  uv_fs_req_cleanup(&req);
+
+  if (r < 0) {
+    ioError = r;
+    return LZMA_PROG_ERROR;
+  }
+
+  info.file_size = stamp.size;
+
+  if (!sidecarPath.empty()) {
+    size_t streamPadding;
+    lzma_index* index = IndexSidecar::Load(sidecarPath, fd, stamp, &allocator, &streamPadding);
+
+    if (index != nullptr) {
+      uint64_t memlimit = info.memlimit == 0 ? UINT64_MAX : info.memlimit;
+
+      // Give the full parse a chance to report how much memory is needed.
+      if (lzma_index_memused(index) <= memlimit) {
+        info.index = index;
+        info.stream_padding = streamPadding;
+        info.memlimit = memlimit;
+        fromSidecar = true;
+        return LZMA_STREAM_END;
+      }
+
+      lzma_index_end(index, &allocator);
+    }
+  }
+
+  info.read_callback = read_fd_cb;
+  info.async = false;
+
+  lzma_ret ret = my_lzma_parse_indexes_from_file(&info);
+
+  if (ret == LZMA_STREAM_END && !sidecarPath.empty()) {
+    // The sidecar is only a cache, so failing to write it is not an error.
+    IndexSidecar::Write(sidecarPath, fd, stamp, info.index, info.stream_padding);
+  }
+
+  std::vector<uint8_t>().swap(window);
+  return ret;
+}
+
+void IndexParser::finishParseFromFD(Function callback, lzma_ret ret) {
+  Napi::Env env = Env();
+
+  isCurrentlyInParseCall = false;
+  detached = false;
+  adjustExternalMemory(nonAdjustedExternalMemory);
+  nonAdjustedExternalMemory = 0;
+  info.read_callback = read_cb;
+
+  if (ioError != 0) {
+    Error error = Error::New(env, uv_strerror(ioError));
+    error.Value()["code"] = String::New(env, uv_err_name(ioError));
+    callback.Call({ error.Value() });
+    return;
+  }
+
+  if (ret != LZMA_STREAM_END) {
+    Error error = lzmaRetError(env, ret);
+    if (info.message) {
+      error.Value()["message"] = String::New(env, info.message);
+    }
+    callback.Call({ error.Value() });
+    return;
+  }
+
+  Object result = getObject();
+  if (!sidecarPath.empty())
+    result["fromSidecar"] = Boolean::New(env, fromSidecar);
+
+  callback.Call({ env.Null(), result });
+}
+
 Object IndexParser::getObject() const {
   Napi::Env env = Env();
   Object obj = Object::New(env);
@@ -529,6 +721,106 @@ Object IndexParser::getObject() const {
   return obj;
 }
 
+namespace {
+  // Fill in the per-block columns of a block table in a single pass over
+  // the index. T is double for Float64Array and uint64_t for BigUint64Array.
+  template <typename T>
+  void fillBlockTable(Napi::Env env, const lzma_index* index, size_t count,
+                      napi_typedarray_type type, Object table) {
+    TypedArrayOf<T> compressedOffset = TypedArrayOf<T>::New(env, count, type);
+    TypedArrayOf<T> compressedSize = TypedArrayOf<T>::New(env, count, type);
+    TypedArrayOf<T> unpaddedSize = TypedArrayOf<T>::New(env, count, type);
+    TypedArrayOf<T> uncompressedOffset = TypedArrayOf<T>::New(env, count, type);
+    TypedArrayOf<T> uncompressedSize = TypedArrayOf<T>::New(env, count, type);
+    Uint32Array stream = Uint32Array::New(env, count, napi_uint32_array);
+    Uint8Array check = Uint8Array::New(env, count, napi_uint8_array);
+
+    T* compressedOffsetData = compressedOffset.Data();
+    T* compressedSizeData = compressedSize.Data();
+    T* unpaddedSizeData = unpaddedSize.Data();
+    T* uncompressedOffsetData = uncompressedOffset.Data();
+    T* uncompressedSizeData = uncompressedSize.Data();
+    uint32_t* streamData = stream.Data();
+    uint8_t* checkData = check.Data();
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+
+    for (size_t i = 0; i < count && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK); i++) {
+      compressedOffsetData[i] = static_cast<T>(iter.block.compressed_file_offset);
+      compressedSizeData[i] = static_cast<T>(iter.block.total_size);
+      unpaddedSizeData[i] = static_cast<T>(iter.block.unpadded_size);
+      uncompressedOffsetData[i] = static_cast<T>(iter.block.uncompressed_file_offset);
+      uncompressedSizeData[i] = static_cast<T>(iter.block.uncompressed_size);
+      streamData[i] = static_cast<uint32_t>(iter.stream.number);
+      checkData[i] = static_cast<uint8_t>(
+          iter.stream.flags ? iter.stream.flags->check : LZMA_CHECK_NONE);
+    }
+
+    table["compressedOffset"] = compressedOffset;
+    table["compressedSize"] = compressedSize;
+    table["unpaddedSize"] = unpaddedSize;
+    table["uncompressedOffset"] = uncompressedOffset;
+    table["uncompressedSize"] = uncompressedSize;
+    table["stream"] = stream;
+    table["check"] = check;
+  }
+
+  template <typename T>
+  int64_t lastNotAbove(const T* data, size_t length, T value) {
+    return (std::upper_bound(data, data + length, value) - data) - 1;
+  }
+}
+
+Value IndexParser::BlockTable(const CallbackInfo& args) {
+  if (info.index == nullptr || isCurrentlyInParseCall)
+    throw Error::New(Env(), "No index has been parsed");
+
+  uint64_t count = lzma_index_block_count(info.index);
+  if (count > SIZE_MAX / sizeof(double))
+    throw lzmaRetError(Env(), LZMA_MEM_ERROR);
+
+  Object table = Object::New(Env());
+  table["count"] = Number::New(Env(), static_cast<double>(count));
+
+  if (args[0].ToBoolean()) {
+    fillBlockTable<uint64_t>(Env(), info.index, count, napi_biguint64_array, table);
+  } else {
+    fillBlockTable<double>(Env(), info.index, count, napi_float64_array, table);
+  }
+
+  return table;
+}
+
+Value IndexParser::LocateBlock(const CallbackInfo& args) {
+  if (!args[0].IsTypedArray())
+    throw TypeError::New(args.Env(), "Expected a block table column");
+
+  TypedArray column = args[0].As<TypedArray>();
+  Napi::Value offset = args[1];
+  int64_t index;
+
+  if (column.TypedArrayType() == napi_float64_array) {
+    bool lossless;
+    double value = offset.IsBigInt() ?
+        static_cast<double>(offset.As<BigInt>().Uint64Value(&lossless)) :
+        offset.ToNumber().DoubleValue();
+
+    index = lastNotAbove(column.As<Float64Array>().Data(), column.ElementLength(), value);
+  } else if (column.TypedArrayType() == napi_biguint64_array) {
+    bool lossless;
+    uint64_t value = offset.IsBigInt() ?
+        offset.As<BigInt>().Uint64Value(&lossless) :
+        static_cast<uint64_t>(offset.ToNumber().Int64Value());
+
+    index = lastNotAbove(column.As<BigUint64Array>().Data(), column.ElementLength(), value);
+  } else {
+    throw TypeError::New(args.Env(), "Expected a block table column");
+  }
+
+  return Number::New(args.Env(), static_cast<double>(index));
+}
+
 Value IndexParser::Parse(const CallbackInfo& args) {
   if (isCurrentlyInParseCall)
     throw Error::New(Env(), "Cannot call IndexParser::Parse recursively");
@@ -562,6 +854,27 @@ Value IndexParser::Parse(const CallbackInfo& args) {
   throw error;
 }
 
+Value IndexParser::ParseFD(const CallbackInfo& args) {
+  if (isCurrentlyInParseCall)
+    throw Error::New(Env(), "Cannot call IndexParser::ParseFD while parsing");
+  if (info.index != nullptr || info.internal != nullptr)
+    throw Error::New(Env(), "IndexParser::ParseFD needs a fresh IndexParser");
+
+  fd = args[0].ToNumber().Int32Value();
+  info.memlimit = NumberToUint64ClampNullMax(args[1]);
+  if (args[2].IsString())
+    sidecarPath = args[2].As<String>();
+  Function callback = args[3].As<Function>();
+
+  isCurrentlyInParseCall = true;
+  detached = true;
+
+  IndexParseWorker* worker = new IndexParseWorker(callback, this);
+  worker->Queue();
+
+  return Env().Undefined();
+}
+
 Value IndexParser::Feed(const CallbackInfo& info) {
   Napi::Value value_v = info[0];
   if (!value_v.IsTypedArray())
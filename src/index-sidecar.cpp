@@ -0,0 +1,348 @@
+#include "liblzma-node.hpp"
+#include <uv.h>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace lzma {
+
+/*
+ * Sidecar file layout, all integers little-endian:
+ *
+ *  0  magic "LZNIDX" and a 16-bit format version
+ *  8  u64 size of the .xz file
+ * 16  i64 mtime of the .xz file, seconds
+ * 24  u32 mtime of the .xz file, nanoseconds
+ * 28  u32 CRC32 of the last Stream Footer of the .xz file
+ * 32  u64 offset of the last Stream Footer in the .xz file
+ * 40  u64 total Stream Padding
+ * 48  u32 number of streams
+ * 52  u32 reserved, zero
+ * 56  for each stream:
+ *       u32 check type, u32 reserved, u64 backward size,
+ *       u64 Stream Padding after the stream,
+ *       u64 size of the Index field, and the Index field itself
+ *     u32 CRC32 of everything before it
+ */
+
+namespace {
+  const char kMagic[6] = { 'L', 'Z', 'N', 'I', 'D', 'X' };
+  const uint16_t kVersion = 1;
+  const size_t kHeaderSize = 56;
+  const size_t kStreamHeaderSize = 32;
+
+  void putU32(std::vector<uint8_t>* out, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+      out->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+
+  void putU64(std::vector<uint8_t>* out, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+      out->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+
+  uint32_t getU32(const uint8_t* in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+      value = (value << 8) | in[i];
+    return value;
+  }
+
+  uint64_t getU64(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+      value = (value << 8) | in[i];
+    return value;
+  }
+
+  // Read exactly count bytes at offset, or return false.
+  bool readAt(int fd, uint8_t* buf, size_t count, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < count) {
+      uv_fs_t req;
+      uv_buf_t uvbuf = uv_buf_init(reinterpret_cast<char*>(buf + done),
+          static_cast<unsigned int>(std::min<size_t>(count - done, 1 << 30)));
+
+      // Without a loop and a callback, this reads synchronously.
+      int r = uv_fs_read(nullptr, &req, fd, &uvbuf, 1, offset + done, nullptr);
+      uv_fs_req_cleanup(&req);
+
+      if (r <= 0)
+        return false;
+
+      done += r;
+    }
+
+    return true;
+  }
+
+  bool footerCRC(int fd, uint64_t offset, uint32_t* crc) {
+    uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+
+    if (!readAt(fd, footer, sizeof(footer), offset))
+      return false;
+
+    *crc = lzma_crc32(footer, sizeof(footer), 0);
+    return true;
+  }
+
+  // A read-only view of a whole file, mapped into memory where possible.
+  class MappedFile {
+    public:
+      explicit MappedFile(const std::string& path) : data(nullptr), size(0), mapped(false) {
+        uv_fs_t req;
+        int fd = uv_fs_open(nullptr, &req, path.c_str(), UV_FS_O_RDONLY, 0, nullptr);
+        uv_fs_req_cleanup(&req);
+        if (fd < 0)
+          return;
+
+        int r = uv_fs_fstat(nullptr, &req, fd, nullptr);
+        uint64_t fileSize = r == 0 ? req.statbuf.st_size : 0;
+        uv_fs_req_cleanup(&req);
+
+        if (r == 0 && fileSize > 0 && fileSize <= SIZE_MAX)
+          load(fd, static_cast<size_t>(fileSize));
+
+        uv_fs_close(nullptr, &req, fd, nullptr);
+        uv_fs_req_cleanup(&req);
+      }
+
+      ~MappedFile() {
+#ifndef _WIN32
+        if (mapped)
+          munmap(const_cast<uint8_t*>(data), size);
+#endif
+      }
+
+      const uint8_t* data;
+      size_t size;
+
+    private:
+      MappedFile(const MappedFile&) = delete;
+      MappedFile& operator=(const MappedFile&) = delete;
+
+      void load(int fd, size_t fileSize) {
+#ifndef _WIN32
+        void* addr = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+          data = static_cast<const uint8_t*>(addr);
+          size = fileSize;
+          mapped = true;
+          return;
+        }
+#endif
+
+        contents.resize(fileSize);
+        if (readAt(fd, contents.data(), fileSize, 0)) {
+          data = contents.data();
+          size = fileSize;
+        }
+      }
+
+      bool mapped;
+      std::vector<uint8_t> contents;
+  };
+}
+
+lzma_index* IndexSidecar::Load(const std::string& path, int fd, const FileStamp& stamp,
+                               const lzma_allocator* allocator, size_t* streamPadding) {
+  MappedFile file(path);
+  const uint8_t* in = file.data;
+  size_t size = file.size;
+
+  if (size < kHeaderSize + 4 ||
+      memcmp(in, kMagic, sizeof(kMagic)) != 0 ||
+      (in[6] | (in[7] << 8)) != kVersion ||
+      getU32(in + size - 4) != lzma_crc32(in, size - 4, 0)) {
+    return nullptr;
+  }
+
+  if (getU64(in + 8) != stamp.size ||
+      static_cast<int64_t>(getU64(in + 16)) != stamp.mtimeSec ||
+      getU32(in + 24) != stamp.mtimeNsec) {
+    return nullptr;
+  }
+
+  // Catches files that were modified in place without changing the mtime.
+  uint32_t crc;
+  if (!footerCRC(fd, getU64(in + 32), &crc) || crc != getU32(in + 28))
+    return nullptr;
+
+  uint64_t padding = getU64(in + 40);
+  uint32_t streams = getU32(in + 48);
+  size_t pos = kHeaderSize;
+  size_t end = size - 4;
+  lzma_index* combined = nullptr;
+
+  for (uint32_t i = 0; i < streams; i++) {
+    if (end - pos < kStreamHeaderSize)
+      goto error;
+
+    lzma_stream_flags flags;
+    memset(&flags, 0, sizeof(flags));
+    flags.version = 0;
+    flags.check = static_cast<lzma_check>(getU32(in + pos));
+    flags.backward_size = getU64(in + pos + 8);
+
+    uint64_t streamPaddingAfter = getU64(in + pos + 16);
+    uint64_t indexSize = getU64(in + pos + 24);
+    pos += kStreamHeaderSize;
+
+    if (indexSize > end - pos)
+      goto error;
+
+    lzma_index* index = nullptr;
+    uint64_t memlimit = UINT64_MAX;
+    size_t indexPos = pos;
+
+    if (lzma_index_buffer_decode(&index, &memlimit, allocator,
+                                 in, &indexPos, pos + indexSize) != LZMA_OK) {
+      goto error;
+    }
+
+    pos += indexSize;
+
+    if (indexPos != pos ||
+        lzma_index_stream_flags(index, &flags) != LZMA_OK ||
+        lzma_index_stream_padding(index, streamPaddingAfter) != LZMA_OK) {
+      lzma_index_end(index, allocator);
+      goto error;
+    }
+
+    if (combined == nullptr) {
+      combined = index;
+    } else if (lzma_index_cat(combined, index, allocator) != LZMA_OK) {
+      lzma_index_end(index, allocator);
+      goto error;
+    }
+  }
+
+  if (pos != end || combined == nullptr || lzma_index_file_size(combined) != stamp.size)
+    goto error;
+
+  *streamPadding = static_cast<size_t>(padding);
+  return combined;
+
+error:
+  lzma_index_end(combined, allocator);
+  return nullptr;
+}
+
+bool IndexSidecar::Write(const std::string& path, int fd, const FileStamp& stamp,
+                         const lzma_index* index, size_t streamPadding) {
+  std::vector<uint8_t> out(kMagic, kMagic + sizeof(kMagic));
+  out.push_back(static_cast<uint8_t>(kVersion));
+  out.push_back(static_cast<uint8_t>(kVersion >> 8));
+
+  lzma_index_iter streamIter;
+  lzma_index_iter_init(&streamIter, index);
+  lzma_vli lastStreamEnd = 0;
+
+  std::vector<uint8_t> streams;
+  uint32_t streamCount = 0;
+
+  lzma_index_iter blockIter;
+  lzma_index_iter_init(&blockIter, index);
+
+  while (!lzma_index_iter_next(&streamIter, LZMA_INDEX_ITER_STREAM)) {
+    // Rebuild the Index of this stream on its own, since the combined
+    // index can only be encoded as a whole.
+    lzma_index* streamIndex = lzma_index_init(nullptr);
+    if (streamIndex == nullptr)
+      return false;
+
+    for (lzma_vli i = 0; i < streamIter.stream.block_count; i++) {
+      if (lzma_index_iter_next(&blockIter, LZMA_INDEX_ITER_BLOCK) ||
+          lzma_index_append(streamIndex, nullptr,
+                            blockIter.block.unpadded_size,
+                            blockIter.block.uncompressed_size) != LZMA_OK) {
+        lzma_index_end(streamIndex, nullptr);
+        return false;
+      }
+    }
+
+    const lzma_stream_flags* flags = streamIter.stream.flags;
+    size_t indexSize = static_cast<size_t>(lzma_index_size(streamIndex));
+    size_t indexPos = streams.size() + kStreamHeaderSize;
+
+    putU32(&streams, flags ? flags->check : LZMA_CHECK_NONE);
+    putU32(&streams, 0);
+    putU64(&streams, flags ? flags->backward_size : LZMA_VLI_UNKNOWN);
+    putU64(&streams, streamIter.stream.padding);
+    putU64(&streams, indexSize);
+    streams.resize(indexPos + indexSize);
+
+    size_t outPos = indexPos;
+    lzma_ret ret = lzma_index_buffer_encode(streamIndex, streams.data(), &outPos, streams.size());
+    lzma_index_end(streamIndex, nullptr);
+
+    if (ret != LZMA_OK)
+      return false;
+
+    lastStreamEnd = streamIter.stream.compressed_offset + streamIter.stream.compressed_size;
+    streamCount++;
+  }
+
+  uint64_t footerOffset = lastStreamEnd - LZMA_STREAM_HEADER_SIZE;
+  uint32_t crc;
+
+  if (streamCount == 0 || !footerCRC(fd, footerOffset, &crc))
+    return false;
+
+  putU64(&out, stamp.size);
+  putU64(&out, static_cast<uint64_t>(stamp.mtimeSec));
+  putU32(&out, stamp.mtimeNsec);
+  putU32(&out, crc);
+  putU64(&out, footerOffset);
+  putU64(&out, streamPadding);
+  putU32(&out, streamCount);
+  putU32(&out, 0);
+  out.insert(out.end(), streams.begin(), streams.end());
+  putU32(&out, lzma_crc32(out.data(), out.size(), 0));
+
+  // Write to a temporary file first, so that readers never see a partially
+  // written sidecar.
+  std::string tmpPath = path + "." + std::to_string(uv_os_getpid()) + ".tmp";
+  uv_fs_t req;
+
+  int outFd = uv_fs_open(nullptr, &req, tmpPath.c_str(),
+                         UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, nullptr);
+  uv_fs_req_cleanup(&req);
+  if (outFd < 0)
+    return false;
+
+  size_t done = 0;
+  bool ok = true;
+
+  while (ok && done < out.size()) {
+    uv_buf_t uvbuf = uv_buf_init(reinterpret_cast<char*>(out.data() + done),
+        static_cast<unsigned int>(std::min<size_t>(out.size() - done, 1 << 30)));
+
+    int r = uv_fs_write(nullptr, &req, outFd, &uvbuf, 1, done, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    ok = r > 0;
+    if (ok)
+      done += r;
+  }
+
+  uv_fs_close(nullptr, &req, outFd, nullptr);
+  uv_fs_req_cleanup(&req);
+
+  if (ok) {
+    ok = uv_fs_rename(nullptr, &req, tmpPath.c_str(), path.c_str(), nullptr) == 0;
+    uv_fs_req_cleanup(&req);
+  }
+
+  if (!ok) {
+    uv_fs_unlink(nullptr, &req, tmpPath.c_str(), nullptr);
+    uv_fs_req_cleanup(&req);
+  }
+
+  return ok;
+}
+
+}
@@ -61,12 +61,14 @@ Value lzmaEasyDecoderMemusage(const CallbackInfo& info) {
 Value lzmaCRC32(const CallbackInfo& info) {
   int64_t arg = info[1].ToNumber();
 
-  std::vector<uint8_t> data;
-
-  if (!readBufferFromObj(info[0], &data))
+  if (!info[0].IsTypedArray())
     throw TypeError::New(info.Env(), "CRC32 expects Buffer as input");
 
-  return Number::New(info.Env(), lzma_crc32(data.data(), data.size(), arg));
+  const uint8_t* data;
+  size_t length;
+  readBufferPointerFromObj(info[0], &data, &length);
+
+  return Number::New(info.Env(), CRC::CRC32(data, length, arg));
 }
 
 Value lzmaRawEncoderMemusage(const CallbackInfo& info) {
@@ -81,4 +83,10 @@ Value lzmaRawDecoderMemusage(const CallbackInfo& info) {
   return Uint64ToNumberMaxNull(info.Env(), lzma_raw_decoder_memusage(filters.array()));
 }
 
+Value lzmaMTEncoderMemusage(const CallbackInfo& info) {
+  const MTOptions mt(info[0]);
+
+  return Uint64ToNumberMaxNull(info.Env(), lzma_stream_encoder_mt_memusage(mt.opts()));
+}
+
 }
@@ -14,11 +14,13 @@
 #include <list>
 #include <set>
 #include <queue>
+#include <deque>
 #include <string>
 #include <utility>
 #include <atomic>
 #include <mutex>
 #include <memory>
+#include <chrono>
 
 namespace lzma {
   using namespace Napi;
@@ -46,6 +48,13 @@ namespace lzma {
    */
   bool readBufferFromObj(Value value, std::vector<uint8_t>* data);
 
+  /**
+   * Like readBufferFromObj(), but without copying. data will point into the
+   * Buffer’s backing store, so the caller needs to keep the Buffer alive for
+   * as long as data is being used.
+   */
+  bool readBufferPointerFromObj(Value value, const uint8_t** data, size_t* length);
+
   /**
    * Return a lzma_options_lzma struct as described by the v8 Object obj.
    */
@@ -68,6 +77,12 @@ namespace lzma {
    */
   uint64_t NumberToUint64ClampNullMax(Value in);
 
+  /**
+   * Return a Buffer that takes ownership of data, which needs to have been
+   * allocated with malloc().
+   */
+  Value MallocedBuffer(Env env, uint8_t* data, size_t length);
+
   /**
    * Return an integer property of an object (which can be passed to Nan::Get),
    * providing a default value if no such property is present
@@ -95,6 +110,7 @@ namespace lzma {
   Value lzmaCRC32(const CallbackInfo& info);
   Value lzmaRawEncoderMemusage(const CallbackInfo& info);
   Value lzmaRawDecoderMemusage(const CallbackInfo& info);
+  Value lzmaMTEncoderMemusage(const CallbackInfo& info);
 
   /* wrappers */
   /**
@@ -137,6 +153,222 @@ namespace lzma {
       lzma_mt opts_;
   };
 
+  /**
+   * Process-wide pool of uninitialized memory for coder output, so that
+   * output buffers can be recycled between coding steps and between streams
+   * instead of being allocated for each step.
+   */
+  class OutputBufferPool {
+    public:
+      /**
+       * Return a block of at least size bytes, or nullptr on allocation failure.
+       */
+      static uint8_t* Acquire(size_t size);
+
+      /**
+       * Give a block obtained from Acquire() back to the pool. size needs to
+       * be the same as the one passed to Acquire().
+       */
+      static void Release(uint8_t* data, size_t size);
+
+      static Napi::Value GetStats(const CallbackInfo& info);
+      static Napi::Value SetLimit(const CallbackInfo& info);
+  };
+
+  /**
+   * Cache for large blocks of memory allocated by liblzma, such as
+   * dictionaries and match finder hash tables, so that they can be reused by
+   * later streams instead of being returned to the operating system.
+   * Blocks are grouped into size classes and kept separately for each
+   * Node.js environment. Cached blocks stay accounted for as external memory.
+   */
+  class BlockCache {
+    public:
+      /**
+       * Round size up to the capacity that Acquire() will provide.
+       * Sizes below the caching threshold are returned unchanged.
+       */
+      static size_t SizeClass(size_t size);
+
+      /**
+       * Allocate a new block of capacity bytes that can be released with
+       * free(). If hugePages is set, the block is aligned to huge page
+       * boundaries and marked for use with transparent huge pages, where
+       * the platform supports that. The pages of the first prefaultLength
+       * bytes of the block are touched before it is returned.
+       */
+      static void* AllocateBlock(size_t capacity, bool hugePages, size_t prefaultLength);
+
+      /**
+       * Return a cached block of exactly capacity bytes, or nullptr.
+       * Blocks allocated with and without hugePages are kept apart.
+       */
+      static void* Acquire(napi_env env, size_t capacity, bool hugePages);
+
+      /**
+       * Try to keep a block of capacity bytes for later use. Returns false
+       * if the block was not cached; the caller still owns it in that case.
+       */
+      static bool Release(napi_env env, void* block, size_t capacity, bool hugePages);
+
+      static void InitializeExports(Object exports);
+      static Napi::Value GetStats(const CallbackInfo& info);
+      static Napi::Value SetLimit(const CallbackInfo& info);
+  };
+
+  /**
+   * Pool of initialized lzma_stream instances whose memory can be reused
+   * by re-initializing them with the same kind of coder, so that the large
+   * match finder and dictionary allocations are not repeated for each stream.
+   * Coders are kept separately for each Node.js environment, because their
+   * memory is accounted for as external memory of that environment.
+   */
+  class CoderPool {
+    public:
+      /**
+       * If a coder for key is available, move it into strm and return true.
+       * strm->allocator is kept, and size is set to the number of bytes
+       * that the coder has allocated.
+       */
+      static bool Take(napi_env env, const std::string& key, lzma_stream* strm, uint64_t* size);
+
+      /**
+       * Try to move the coder from strm, which has allocated size bytes, into
+       * the pool. Returns false if the pool is full; in that case strm is
+       * left untouched.
+       */
+      static bool Put(napi_env env, const std::string& key, lzma_stream* strm, uint64_t size);
+
+      static Napi::Value GetStats(const CallbackInfo& info);
+      static Napi::Value SetLimit(const CallbackInfo& info);
+  };
+
+  /**
+   * Opt-in timeline of coding work in the Chrome trace-event format. Each
+   * thread records spans into its own ring buffer, without locking; when
+   * tracing is off, a span costs a single relaxed atomic load.
+   */
+  class Tracer {
+    public:
+      static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+      /**
+       * Nanoseconds on the steady clock, which all timestamps refer to.
+       */
+      static uint64_t Now() { return Nanos(std::chrono::steady_clock::now()); }
+      static uint64_t Nanos(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+      }
+
+      /**
+       * Identifies a stream or index parser in the trace.
+       */
+      static uint64_t NextId();
+
+      /**
+       * Name the calling thread in the trace. name must be a string literal.
+       */
+      static void SetThreadName(const char* name);
+
+      /**
+       * Record that id was busy with name (a string literal) on the calling
+       * thread from start to end. Waiting spans (async) are shown on a
+       * track of their own rather than on the thread, which may have been
+       * busy with something else in the meantime.
+       */
+      static void Record(const char* name, uint64_t id, uint64_t start, uint64_t end,
+                         bool async = false);
+
+      /**
+       * Records a span from its construction to its destruction.
+       */
+      class Span {
+        public:
+          Span(const char* name, uint64_t id)
+            : name(Enabled() ? name : nullptr), id(id), start(this->name ? Now() : 0) {}
+          ~Span() {
+            if (name)
+              Record(name, id, start, Now());
+          }
+
+        private:
+          const char* name;
+          uint64_t id;
+          uint64_t start;
+      };
+
+      static void InitializeExports(Object exports);
+
+    private:
+      static Napi::Value Start(const CallbackInfo& info);
+      static Napi::Value Stop(const CallbackInfo& info);
+      static Napi::Value Dump(const CallbackInfo& info);
+
+      static std::atomic<bool> enabled;
+  };
+
+  class LZMAStream;
+
+  /**
+   * Dedicated threads for the asynchronous coding steps of LZMAStreams, so
+   * that coding does not compete with fs and dns for the libuv thread pool.
+   * A stream is queued at most once and never coded on two threads at the
+   * same time. Each thread has its own queues and steals work from the
+   * others once they are empty; streams with latency priority are always
+   * picked before bulk streams. If a work quantum is set, a coding step ends
+   * once it has used it up, and the stream is queued again behind the others,
+   * so that a single large write cannot hold up small streams for long.
+   */
+  class CodingThreadPool {
+    public:
+      enum Priority {
+        PRIORITY_LATENCY = 0,
+        PRIORITY_BULK = 1
+      };
+
+      /**
+       * Queue a coding step for stream. stream->invokeBufferHandlers() is
+       * called on the main thread once it has run. Input that arrives
+       * before the step has started is handled by the same step.
+       */
+      static void Schedule(LZMAStream* stream, Priority priority);
+
+      /**
+       * Remove stream from the queues, waiting until it is no longer being
+       * coded on any thread.
+       */
+      static void Forget(LZMAStream* stream);
+
+      /**
+       * Work that is not tied to a stream, e.g. decoding a single block.
+       */
+      class Task {
+        public:
+          virtual ~Task() {}
+
+          /** Runs on a pool thread. Must not touch JS. */
+          virtual void Execute() = 0;
+
+          /**
+           * Runs on the main thread once Execute() has finished. The task
+           * is deleted afterwards.
+           */
+          virtual void OnComplete(Napi::Env env) = 0;
+      };
+
+      /**
+       * Queue a task, which takes its turn after the latency streams and
+       * before the bulk streams. Takes ownership of task. If env goes away
+       * before the task has completed, it is leaked, since the references
+       * it holds cannot be released anymore.
+       */
+      static void Post(napi_env env, Task* task);
+
+      static Napi::Value SetThreads(const CallbackInfo& info);
+      static Napi::Value SetQuantum(const CallbackInfo& info);
+      static Napi::Value GetStats(const CallbackInfo& info);
+  };
+
   /**
    * Node.js object wrap for lzma_stream wrapper. Corresponds to exports.Stream
    */
@@ -147,14 +379,43 @@ namespace lzma {
       static void InitializeExports(Object exports);
 
     /* regard as private: */
-      void doLZMACodeFromAsync();
+      /**
+       * Run a coding step that stops after quantumBytes bytes of input and
+       * output or quantumNanos nanoseconds, whichever comes first; zero means
+       * no limit. Returns true if it stopped before all work was done.
+       * queuedNanos is the time the step has waited for a thread.
+       */
+      bool doLZMACodeFromAsync(uint64_t quantumBytes, uint64_t quantumNanos,
+                               uint64_t queuedNanos);
       void invokeBufferHandlers(bool hasLock);
       void* alloc(size_t nmemb, size_t size);
       void free(void* ptr);
 
+      /**
+       * Allocate memory for liblzma the way alloc() does, without accounting
+       * for it on any stream. newlyAllocated is set to the number of bytes
+       * that had to be requested from the system rather than the BlockCache.
+       */
+      static void* allocation(napi_env env, size_t size, size_t hugePageThreshold,
+                              bool prefault, size_t* capacity, size_t* newlyAllocated);
+
+      /**
+       * Free memory obtained from alloc() or allocation() without accounting for it on any
+       * stream. Returns the number of bytes that were returned to the
+       * system rather than to the BlockCache.
+       */
+      static size_t freeAllocation(napi_env env, void* ptr, size_t* capacity);
+
+      const uint64_t traceId;
+
+      /**
+       * Counters summed up over all streams in the process.
+       */
+      static Napi::Value GetAggregateStats(const CallbackInfo& info);
+
     private:
       void resetUnderlying();
-      void doLZMACode();
+      bool doLZMACode(uint64_t quantumBytes = 0, uint64_t quantumNanos = 0);
 
       static Napi::Value New(const CallbackInfo& info);
 
@@ -169,10 +430,44 @@ namespace lzma {
 
       AsyncContext async_context;
       std::atomic<int64_t> nonAdjustedExternalMemory;
+      std::atomic<int64_t> allocatedBytes; // currently allocated by the coder
       std::mutex mutex;
 
+      /**
+       * Performance counters for getStats(), kept for the lifetime of the
+       * object. All but peakAllocatedBytes are guarded by mutex; liblzma
+       * may allocate memory from the MT encoder's threads.
+       */
+      struct Stats {
+        Stats() : codeNanos(0), queueNanos(0), mutexWaitNanos(0), bytesIn(0), bytesOut(0),
+                  codeCalls(0), callbacks(0), outputChunks(0), peakAllocatedBytes(0) {}
+
+        uint64_t codeNanos; // inside lzma_code()
+        uint64_t queueNanos; // waiting for a coding thread
+        uint64_t mutexWaitNanos; // waiting for mutex
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        uint64_t codeCalls;
+        uint64_t callbacks;
+        uint64_t outputChunks;
+        std::atomic<uint64_t> peakAllocatedBytes;
+      };
+
+      Stats stats;
+
+      /**
+       * Lock mutex, accounting for the time spent waiting if it is contended.
+       */
+      void lockMutex(std::unique_lock<std::mutex>* lock);
+      void accountAllocation(int64_t bytes);
+      Napi::Value GetStats(const CallbackInfo& info);
+
       void ResetUnderlying(const CallbackInfo& info);
       Napi::Value SetBufsize(const CallbackInfo& info);
+      void SetCoderPoolKey(const CallbackInfo& info);
+      void SetHugePages(const CallbackInfo& info);
+      void SetPriority(const CallbackInfo& info);
+      void SetAdaptiveBufsize(const CallbackInfo& info);
       void Code(const CallbackInfo& info);
       Napi::Value Memusage(const CallbackInfo& info);
       Napi::Value MemlimitGet(const CallbackInfo& info);
@@ -191,42 +486,97 @@ namespace lzma {
       lzma_allocator allocator;
       lzma_stream _;
       size_t bufsize;
-      std::string error;
 
-      bool shouldFinish;
-      size_t processedChunks;
-      lzma_ret lastCodeResult;
-      std::queue<std::vector<uint8_t>> inbufs;
-      std::queue<std::vector<uint8_t>> outbufs;
-  };
+      /**
+       * If non-empty, the coder is taken from the CoderPool when it is
+       * initialized and given back to it when it is reset.
+       */
+      std::string coderPoolKey;
+      void takePooledCoder();
+
+      /**
+       * If adaptiveBufsizeMax is non-zero, the size of each output buffer is
+       * estimated from the pending input and the ratio of output to input
+       * seen so far, and clamped to [adaptiveBufsizeMin, adaptiveBufsizeMax].
+       */
+      size_t adaptiveBufsizeMin;
+      size_t adaptiveBufsizeMax;
+      size_t nextOutputBufferSize();
+
+      // The queue of the CodingThreadPool that coding steps are put in.
+      CodingThreadPool::Priority codingPriority;
+
+      /**
+       * Allocations of at least hugePageThreshold bytes use transparent huge
+       * pages, if it is non-zero. If prefault is set, newly allocated memory
+       * is touched right away instead of on first use by liblzma.
+       */
+      size_t hugePageThreshold;
+      bool prefault;
+      std::string error;
 
-  /**
-   * Async worker for a single coding step.
-   */
-  class LZMAStreamCodingWorker : public AsyncWorker {
-    public:
-      LZMAStreamCodingWorker(LZMAStream* stream_)
-        : AsyncWorker(Function(stream_->Env(), nullptr), "LZMAStreamCodingWorker"),
-          stream(stream_) {
-        Receiver().Set(static_cast<uint32_t>(0), stream->Value());
-      }
+      /**
+       * A chunk of input that liblzma reads directly from the Buffer it was
+       * passed in; the reference keeps the Buffer alive until liblzma is
+       * done with it. Buffers that were passed to code() together as an
+       * array are queued one after another and count as a single chunk,
+       * which is processed once the last of them (endsBatch) is consumed.
+       */
+      struct InputChunk {
+        const uint8_t* data;
+        size_t length;
+        ObjectReference buffer;
+        bool endsBatch;
+      };
 
-      ~LZMAStreamCodingWorker() {}
+      /**
+       * Output produced by liblzma. The memory comes from the
+       * OutputBufferPool without being initialized and is handed over to JS
+       * as an external Buffer where possible, so that no copies are involved.
+       */
+      struct OutputChunk {
+        uint8_t* data;
+        size_t length;
+        size_t capacity;
+      };
 
-      void Execute() override {
-        stream->doLZMACodeFromAsync();
-      }
+      void releaseConsumedInput();
+      Napi::Value outputChunkToBuffer(const OutputChunk& chunk);
+
+      /**
+       * Decoders for .xz and .lzma input accept several concatenated streams,
+       * separated by Stream Padding. Once a stream ends, the decoder is
+       * re-initialized with the same settings for the next one.
+       */
+      enum RestartKind {
+        RESTART_NONE,
+        RESTART_STREAM_DECODER,
+        RESTART_AUTO_DECODER
+      };
 
-    private:
-      void OnOK() {
-        stream->invokeBufferHandlers(false);
-      }
+      lzma_ret restartDecoder();
 
-      void OnOK(const Error& e) {
-        stream->invokeBufferHandlers(false);
-      }
+      RestartKind restartKind;
+      uint64_t restartMemlimit;
+      uint32_t restartFlags;
+      bool betweenStreams;
 
-      LZMAStream* stream;
+      bool shouldFinish;
+      size_t processedChunks;
+      lzma_ret lastCodeResult;
+      std::queue<InputChunk> inbufs;
+      size_t inbufsLength; // total bytes in inbufs
+      // The chunk liblzma is reading from. If a coding step ends in the
+      // middle of it, the next step continues there.
+      ObjectReference currentInbuf;
+      bool currentInbufEndsBatch;
+      bool partialChunk;
+      // The last call to lzma_code() made no progress.
+      bool stalled;
+      // References can only be released on the main thread, so they are
+      // parked here by doLZMACode() until invokeBufferHandlers() runs.
+      std::deque<ObjectReference> consumedInbufs;
+      std::queue<OutputChunk> outbufs;
   };
 
   class IndexParser : public ObjectWrap<IndexParser> {
@@ -238,6 +588,26 @@ namespace lzma {
 
     /* regard as private: */
       int64_t readCallback(void* opaque, uint8_t* buf, size_t count, int64_t offset);
+      int64_t readFromFD(uint8_t* buf, size_t count, int64_t offset);
+      void adjustExternalMemory(int64_t bytesChange);
+
+      /**
+       * Parse the indexes of the file descriptor passed to parseFD(),
+       * reading from it directly. Does not touch JS and is run on the
+       * thread pool.
+       */
+      lzma_ret parseFromFD();
+
+      /**
+       * Report the result of parseFromFD() to JS.
+       */
+      void finishParseFromFD(Function callback, lzma_ret ret);
+
+      /**
+       * The combined index of all streams, or nullptr if parsing has not
+       * finished successfully.
+       */
+      const lzma_index* index() const { return info.index; }
 
     private:
       lzma_index_parser_data info;
@@ -247,11 +617,259 @@ namespace lzma {
       size_t currentReadSize;
       bool isCurrentlyInParseCall;
 
+      // State for parsing directly from a file descriptor. Reads are served
+      // from a window of the file that is larger than what the parser asks
+      // for, to keep the number of syscalls low.
+      int fd;
+      int ioError;
+      std::vector<uint8_t> window;
+      uint64_t windowOffset;
+      uint64_t lastReadEnd;
+
+      // Index sidecar to load from or write to when parsing from a file
+      // descriptor, if any.
+      std::string sidecarPath;
+      bool fromSidecar;
+
+      // Set while allocations happen off the main thread, in which case
+      // changes in external memory are reported afterwards.
+      bool detached;
+      int64_t nonAdjustedExternalMemory;
+
+      uint64_t traceId;
+
       Object getObject() const;
 
       void Init(const CallbackInfo& info);
       Napi::Value Feed(const CallbackInfo& info);
       Napi::Value Parse(const CallbackInfo& info);
+      Napi::Value ParseFD(const CallbackInfo& info);
+      Napi::Value BlockTable(const CallbackInfo& info);
+      static Napi::Value LocateBlock(const CallbackInfo& info);
+  };
+
+  /**
+   * Reads and writes index sidecar files, which hold a copy of the combined
+   * index of an .xz file so that reopening it does not require going through
+   * all of its stream footers and indexes again. A sidecar is only used while
+   * the size, modification time and last stream footer of the file match.
+   */
+  class IndexSidecar {
+    public:
+      struct FileStamp {
+        uint64_t size;
+        int64_t mtimeSec;
+        uint32_t mtimeNsec;
+      };
+
+      /**
+       * Returns the index stored in the sidecar at path, or nullptr if it
+       * is missing, corrupt or does not match the file.
+       */
+      static lzma_index* Load(const std::string& path, int fd, const FileStamp& stamp,
+                              const lzma_allocator* allocator, size_t* streamPadding);
+
+      static bool Write(const std::string& path, int fd, const FileStamp& stamp,
+                        const lzma_index* index, size_t streamPadding);
+  };
+
+  /**
+   * Decodes the blocks of an .xz file independently of each other, using the
+   * block table of an index parsed by IndexParser. The compressed data is
+   * taken from a Buffer, read from a file descriptor on the coding thread that
+   * decodes the block, or passed in for each block separately.
+   * Corresponds to exports.BlockDecoder
+   */
+  class BlockDecoder : public ObjectWrap<BlockDecoder> {
+    public:
+      explicit BlockDecoder(const CallbackInfo& info);
+
+      static void InitializeExports(Object exports);
+
+      struct Block {
+        uint64_t compressedOffset; // start of the block header in the file
+        uint64_t totalSize;
+        uint64_t unpaddedSize;
+        uint64_t uncompressedOffset;
+        uint64_t uncompressedSize;
+        lzma_check check;
+      };
+
+    /* regard as private: */
+      const Block& block(size_t i) const { return blocks[i]; }
+      uint64_t memoryLimit() const { return memlimit; }
+
+      /**
+       * Decode block i into out, which needs to provide room for its
+       * uncompressed size. The compressed data is taken from input if it is
+       * not nullptr, and from the source otherwise. Sets ioError to a libuv
+       * error code if reading the input failed. Can be called from any thread.
+       */
+      lzma_ret decodeBlock(size_t i, uint8_t* out, const lzma_allocator* allocator,
+                           const uint8_t* input, size_t inputLength, int* ioError);
+
+    private:
+      int readBlock(const Block& block, std::vector<uint8_t>* buf, const uint8_t** data);
+      size_t locate(uint64_t uncompressedOffset) const;
+
+      std::vector<Block> blocks;
+      ObjectReference source;
+      const uint8_t* sourceData;
+      size_t sourceLength;
+      int fd; // -1 if the source is not a file descriptor
+      uint64_t memlimit;
+
+      Napi::Value BlockCount(const CallbackInfo& info);
+      Napi::Value GetBlock(const CallbackInfo& info);
+      Napi::Value Locate(const CallbackInfo& info);
+      void Decode(const CallbackInfo& info);
+  };
+
+  /**
+   * lzma_allocator for coders that are not attached to an LZMAStream, such
+   * as those used for one-shot coding. Memory is served the same way as for
+   * streams. Changes in external memory are reported when the allocator is
+   * destroyed, which needs to happen on the main thread.
+   */
+  class DetachedAllocator {
+    public:
+      explicit DetachedAllocator(napi_env env);
+      ~DetachedAllocator();
+
+      const lzma_allocator* get() const { return &allocator; }
+
+    /* regard as private: */
+      void* alloc(size_t nmemb, size_t size);
+      void free(void* ptr);
+
+    private:
+      DetachedAllocator(const DetachedAllocator&) = delete;
+      DetachedAllocator& operator=(const DetachedAllocator&) = delete;
+
+      napi_env env;
+      lzma_allocator allocator;
+      int64_t nonAdjustedExternalMemory;
+  };
+
+  /**
+   * Compresses or decompresses a complete Buffer in one go using the liblzma
+   * buffer coding functions, which avoids the per-chunk overhead of streams.
+   * Backs compressSync()/decompressSync(), their asynchronous variants and
+   * LZMA().compress()/LZMA().decompress().
+   */
+  class BufferCoder {
+    public:
+      BufferCoder(napi_env env, bool encode, const uint8_t* in, size_t inSize);
+      ~BufferCoder();
+
+      static void InitializeExports(Object exports);
+
+      /**
+       * Perform the actual coding. Does not touch JS and can be called from
+       * a worker thread.
+       */
+      void Run();
+
+      /**
+       * Return the output as a Buffer, or throw the error that Run() ran
+       * into. Needs to be called on the main thread.
+       */
+      Napi::Value TakeResult(Napi::Env env);
+
+      uint32_t preset;
+      lzma_check check;
+      uint64_t memlimit;
+      // Produce .lzma instead of .xz output, using aloneOptions.
+      bool alone;
+      lzma_options_lzma aloneOptions;
+
+    private:
+      lzma_ret compress();
+      lzma_ret compressAlone();
+      lzma_ret decompress();
+      lzma_ret decompressStreaming();
+      bool uncompressedSizeFromIndex(uint64_t* size);
+      bool reserveOutput(size_t capacity);
+      void releaseOutput();
+
+      bool encode;
+      const uint8_t* in;
+      size_t inSize;
+
+      uint8_t* out;
+      size_t outSize;
+      size_t outCapacity;
+      lzma_ret result;
+
+      DetachedAllocator allocator;
+  };
+
+  /**
+   * CRC32 and CRC64 with the same results as lzma_crc32() and lzma_crc64(),
+   * computed with carry-less multiplication (PCLMULQDQ on x86, PMULL on
+   * ARMv8) where the CPU supports it. The kernel is picked when the module
+   * is loaded, with liblzma's table-based implementation as the fallback.
+   */
+  class CRC {
+    public:
+      static uint32_t CRC32(const uint8_t* buf, size_t size, uint32_t crc);
+      static uint64_t CRC64(const uint8_t* buf, size_t size, uint64_t crc);
+
+      static void InitializeExports(Object exports);
+      static Napi::Value GetKernel(const CallbackInfo& info);
+      static Napi::Value SetKernel(const CallbackInfo& info);
+  };
+
+  /**
+   * Incremental CRC32, CRC64 or SHA-256 checksum, as used for the integrity
+   * checks of .xz files. Input is read directly from the Buffers passed in.
+   * Large Buffers and file descriptors can be hashed on the thread pool,
+   * during which the hasher cannot be used otherwise.
+   */
+  class Hasher : public ObjectWrap<Hasher> {
+    public:
+      explicit Hasher(const CallbackInfo& info);
+
+      static void InitializeExports(Object exports);
+
+    /* regard as private: */
+      /**
+       * Add data to the checksum. Does not touch JS and can be called from
+       * a worker thread.
+       */
+      void update(const uint8_t* data, size_t length);
+
+      /**
+       * Add up to length bytes (all, if length is UINT64_MAX) of fd starting
+       * at offset to the checksum. Returns 0 or a libuv error code, and sets
+       * hashed to the number of bytes that were read.
+       */
+      int updateFromFD(int fd, uint64_t offset, uint64_t length, uint64_t* hashed);
+
+      bool busy;
+
+    private:
+      struct Sha256 {
+        uint32_t state[8];
+        uint8_t block[64];
+        uint64_t length;
+      };
+
+      static void sha256Init(Sha256* sha);
+      static void sha256Update(Sha256* sha, const uint8_t* data, size_t length);
+      static void sha256Finish(Sha256 sha, uint8_t* digest);
+
+      void checkIdle();
+
+      Napi::Value Update(const CallbackInfo& info);
+      Napi::Value UpdateAsync(const CallbackInfo& info);
+      Napi::Value UpdateFD(const CallbackInfo& info);
+      Napi::Value Digest(const CallbackInfo& info);
+
+      lzma_check check;
+      uint32_t crc32;
+      uint64_t crc64;
+      Sha256 sha256;
   };
 }
 
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cassert>
 #include <climits>
+#include <chrono>
 
 namespace lzma {
 
@@ -20,15 +21,83 @@ namespace {
 
     return strm->free(ptr);
   }
+
+  typedef std::chrono::steady_clock Clock;
+
+  uint64_t nanosSince(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+  }
+
+  void raiseTo(std::atomic<uint64_t>* peak, uint64_t value) {
+    uint64_t current = peak->load(std::memory_order_relaxed);
+    while (value > current &&
+           !peak->compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+  }
+
+  // The process-wide sums of the per-stream counters.
+  struct AggregateStats {
+    AggregateStats() : streams(0), codeNanos(0), queueNanos(0), mutexWaitNanos(0),
+                       bytesIn(0), bytesOut(0), codeCalls(0), callbacks(0),
+                       outputChunks(0), allocatedBytes(0), peakAllocatedBytes(0) {}
+
+    std::atomic<int64_t> streams;
+    std::atomic<uint64_t> codeNanos;
+    std::atomic<uint64_t> queueNanos;
+    std::atomic<uint64_t> mutexWaitNanos;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> codeCalls;
+    std::atomic<uint64_t> callbacks;
+    std::atomic<uint64_t> outputChunks;
+    std::atomic<int64_t> allocatedBytes;
+    std::atomic<uint64_t> peakAllocatedBytes;
+  };
+
+  AggregateStats& aggregateStats() {
+    static AggregateStats* stats = new AggregateStats();
+    return *stats;
+  }
+
+  Object statsToObject(Napi::Env env, uint64_t codeNanos, uint64_t queueNanos,
+                       uint64_t mutexWaitNanos, uint64_t bytesIn, uint64_t bytesOut,
+                       uint64_t codeCalls, uint64_t callbacks, uint64_t outputChunks,
+                       int64_t allocatedBytes, uint64_t peakAllocatedBytes) {
+    Object obj = Object::New(env);
+    obj["codeMs"] = Number::New(env, codeNanos / 1e6);
+    obj["queueMs"] = Number::New(env, queueNanos / 1e6);
+    obj["mutexWaitMs"] = Number::New(env, mutexWaitNanos / 1e6);
+    obj["bytesIn"] = Number::New(env, static_cast<double>(bytesIn));
+    obj["bytesOut"] = Number::New(env, static_cast<double>(bytesOut));
+    obj["codeCalls"] = Number::New(env, static_cast<double>(codeCalls));
+    obj["callbacks"] = Number::New(env, static_cast<double>(callbacks));
+    obj["outputChunks"] = Number::New(env, static_cast<double>(outputChunks));
+    obj["allocatedBytes"] = Number::New(env, static_cast<double>(allocatedBytes));
+    obj["peakAllocatedBytes"] = Number::New(env, static_cast<double>(peakAllocatedBytes));
+    return obj;
+  }
 }
 
 LZMAStream::LZMAStream(const CallbackInfo& info) :
   ObjectWrap(info),
+  traceId(Tracer::NextId()),
   async_context(info.Env(), "LZMAStream"),
   bufsize(65536),
+  adaptiveBufsizeMin(0),
+  adaptiveBufsizeMax(0),
+  codingPriority(CodingThreadPool::PRIORITY_LATENCY),
+  hugePageThreshold(0),
+  prefault(false),
+  restartKind(RESTART_NONE),
+  restartMemlimit(UINT64_MAX),
+  restartFlags(0),
+  betweenStreams(false),
   shouldFinish(false),
   processedChunks(0),
-  lastCodeResult(LZMA_OK)
+  lastCodeResult(LZMA_OK),
+  inbufsLength(0),
+  currentInbufEndsBatch(false),
+  partialChunk(false),
+  stalled(false)
 {
   std::memset(&_, 0, sizeof(lzma_stream));
 
@@ -38,46 +107,177 @@ LZMAStream::LZMAStream(const CallbackInfo& info) :
   _.allocator = &allocator;
 
   nonAdjustedExternalMemory = 0;
+  allocatedBytes = 0;
+  aggregateStats().streams++;
   MemoryManagement::AdjustExternalMemory(info.Env(), sizeof(LZMAStream));
 }
 
 void LZMAStream::resetUnderlying() {
-  if (_.internal != nullptr)
-    lzma_end(&_);
+  if (_.internal != nullptr) {
+    // Coders that ended in an error state are not worth keeping around.
+    bool reusable = !coderPoolKey.empty() &&
+        (lastCodeResult == LZMA_OK || lastCodeResult == LZMA_STREAM_END);
+
+    if (reusable && CoderPool::Put(Env(), coderPoolKey, &_, allocatedBytes))
+      accountAllocation(-allocatedBytes);
+    else
+      lzma_end(&_);
+  }
 
   reportAdjustedExternalMemoryToV8();
   std::memset(&_, 0, sizeof(lzma_stream));
   _.allocator = &allocator;
   lastCodeResult = LZMA_OK;
   processedChunks = 0;
+  restartKind = RESTART_NONE;
+  restartMemlimit = UINT64_MAX;
+  restartFlags = 0;
+  betweenStreams = false;
+  partialChunk = false;
+  stalled = false;
+  currentInbufEndsBatch = false;
+  currentInbuf.Reset();
 }
 
 LZMAStream::~LZMAStream() {
+  CodingThreadPool::Forget(this);
+
+  // Streams that are garbage collected may be destroyed during environment
+  // teardown, when the CoderPool no longer accepts new coders.
+  coderPoolKey.clear();
   resetUnderlying();
 
+  while (!outbufs.empty()) {
+    OutputBufferPool::Release(outbufs.front().data, outbufs.front().capacity);
+    outbufs.pop();
+  }
+
+  aggregateStats().streams--;
   MemoryManagement::AdjustExternalMemory(Env(), -int64_t(sizeof(LZMAStream)));
 }
 
-void* LZMAStream::alloc(size_t nmemb, size_t size) {
-  size_t nBytes = nmemb * size + sizeof(size_t);
+namespace {
+  // Precedes every allocation handed to liblzma. Its size keeps the
+  // returned memory aligned to 16 bytes.
+  struct AllocationHeader {
+    size_t capacity;
+    size_t hugePages;
+  };
+}
 
-  size_t* result = static_cast<size_t*>(::malloc(nBytes));
+void* LZMAStream::alloc(size_t nmemb, size_t size) {
+  size_t capacity, newlyAllocated;
+  void* result = allocation(Env(), nmemb * size, hugePageThreshold, prefault,
+                            &capacity, &newlyAllocated);
   if (!result)
     return result;
 
-  *result = nBytes;
-  adjustExternalMemory(static_cast<int64_t>(nBytes));
+  adjustExternalMemory(static_cast<int64_t>(newlyAllocated));
+  accountAllocation(static_cast<int64_t>(capacity));
+  return result;
+}
+
+void LZMAStream::accountAllocation(int64_t bytes) {
+  AggregateStats& total = aggregateStats();
+
+  int64_t current = allocatedBytes += bytes;
+  int64_t totalCurrent = total.allocatedBytes += bytes;
+
+  if (bytes > 0) {
+    raiseTo(&stats.peakAllocatedBytes, static_cast<uint64_t>(current));
+    raiseTo(&total.peakAllocatedBytes, static_cast<uint64_t>(totalCurrent));
+  }
+}
+
+void* LZMAStream::allocation(napi_env env, size_t size, size_t hugePageThreshold,
+                             bool prefault, size_t* capacity, size_t* newlyAllocated) {
+  *capacity = BlockCache::SizeClass(size + sizeof(AllocationHeader));
+  *newlyAllocated = 0;
+  bool hugePages = hugePageThreshold != 0 && *capacity >= hugePageThreshold;
+
+  // Blocks from the cache are already accounted for as external memory.
+  AllocationHeader* result = static_cast<AllocationHeader*>(
+      BlockCache::Acquire(env, *capacity, hugePages));
+  if (!result) {
+    result = static_cast<AllocationHeader*>(
+        BlockCache::AllocateBlock(*capacity, hugePages,
+                                  prefault ? size + sizeof(AllocationHeader) : 0));
+    if (!result)
+      return result;
+
+    *newlyAllocated = *capacity;
+  }
+
+  result->capacity = *capacity;
+  result->hugePages = hugePages;
   return static_cast<void*>(result + 1);
 }
 
+namespace {
+  extern "C" void* LZMA_API_CALL
+  alloc_for_detached(void* opaque, size_t nmemb, size_t size) {
+    DetachedAllocator* allocator = static_cast<DetachedAllocator*>(opaque);
+
+    return allocator->alloc(nmemb, size);
+  }
+
+  extern "C" void LZMA_API_CALL
+  free_for_detached(void* opaque, void* ptr) {
+    DetachedAllocator* allocator = static_cast<DetachedAllocator*>(opaque);
+
+    return allocator->free(ptr);
+  }
+}
+
+DetachedAllocator::DetachedAllocator(napi_env env) :
+  env(env),
+  nonAdjustedExternalMemory(0)
+{
+  allocator.alloc = alloc_for_detached;
+  allocator.free = free_for_detached;
+  allocator.opaque = static_cast<void*>(this);
+}
+
+DetachedAllocator::~DetachedAllocator() {
+  if (nonAdjustedExternalMemory != 0)
+    MemoryManagement::AdjustExternalMemory(env, nonAdjustedExternalMemory);
+}
+
+void* DetachedAllocator::alloc(size_t nmemb, size_t size) {
+  size_t capacity, newlyAllocated;
+  void* result = LZMAStream::allocation(env, nmemb * size, 0, false,
+                                        &capacity, &newlyAllocated);
+
+  nonAdjustedExternalMemory += newlyAllocated;
+  return result;
+}
+
+void DetachedAllocator::free(void* ptr) {
+  size_t capacity;
+
+  nonAdjustedExternalMemory -= LZMAStream::freeAllocation(env, ptr, &capacity);
+}
+
 void LZMAStream::free(void* ptr) {
+  size_t capacity = 0;
+  int64_t freed = static_cast<int64_t>(freeAllocation(Env(), ptr, &capacity));
+
+  accountAllocation(-static_cast<int64_t>(capacity));
+  adjustExternalMemory(-freed);
+}
+
+size_t LZMAStream::freeAllocation(napi_env env, void* ptr, size_t* capacity) {
   if (!ptr)
-    return;
+    return 0;
+
+  AllocationHeader* orig = static_cast<AllocationHeader*>(ptr) - 1;
+  *capacity = orig->capacity;
 
-  size_t* orig = static_cast<size_t*>(ptr) - 1;
+  if (BlockCache::Release(env, static_cast<void*>(orig), *capacity, orig->hugePages != 0))
+    return 0;
 
-  adjustExternalMemory(-static_cast<int64_t>(*orig));
-  return ::free(static_cast<void*>(orig));
+  ::free(static_cast<void*>(orig));
+  return *capacity;
 }
 
 void LZMAStream::reportAdjustedExternalMemoryToV8() {
@@ -85,7 +285,7 @@ void LZMAStream::reportAdjustedExternalMemoryToV8() {
   if (to_be_reported == 0)
     return;
 
-  MemoryManagement::AdjustExternalMemory(Env(), nonAdjustedExternalMemory);
+  MemoryManagement::AdjustExternalMemory(Env(), to_be_reported);
 }
 
 void LZMAStream::adjustExternalMemory(int64_t bytesChange) {
@@ -107,34 +307,182 @@ Value LZMAStream::SetBufsize(const CallbackInfo& info) {
 
     oldBufsize = bufsize;
 
-    if (newBufsize && newBufsize != UINT_MAX)
+    if (newBufsize && newBufsize != SIZE_MAX)
       bufsize = newBufsize;
   }
 
   return Number::New(Env(), oldBufsize);
 }
 
+void LZMAStream::SetHugePages(const CallbackInfo& info) {
+  size_t threshold = 0;
+
+  if (!info[0].IsUndefined() && !info[0].IsNull()) {
+    threshold = NumberToUint64ClampNullMax(info[0]);
+
+    if (threshold == 0 || threshold == SIZE_MAX)
+      throw RangeError::New(Env(), "Invalid huge page threshold");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  hugePageThreshold = threshold;
+  prefault = info[1].ToBoolean();
+}
+
+void LZMAStream::SetPriority(const CallbackInfo& info) {
+  std::string priority = info[0].ToString();
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (priority == "latency")
+    codingPriority = CodingThreadPool::PRIORITY_LATENCY;
+  else if (priority == "bulk")
+    codingPriority = CodingThreadPool::PRIORITY_BULK;
+  else
+    throw TypeError::New(Env(), "Priority must be 'latency' or 'bulk'");
+}
+
+void LZMAStream::SetCoderPoolKey(const CallbackInfo& info) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (info[0].IsUndefined() || info[0].IsNull())
+    coderPoolKey.clear();
+  else
+    coderPoolKey = info[0].ToString();
+}
+
+void LZMAStream::takePooledCoder() {
+  uint64_t size;
+
+  if (_.internal == nullptr && !coderPoolKey.empty() &&
+      CoderPool::Take(Env(), coderPoolKey, &_, &size)) {
+    accountAllocation(static_cast<int64_t>(size));
+  }
+}
+
+void LZMAStream::SetAdaptiveBufsize(const CallbackInfo& info) {
+  size_t min = 0, max = 0;
+
+  if (!info[0].IsUndefined() && !info[0].IsNull()) {
+    min = NumberToUint64ClampNullMax(info[0]);
+    max = NumberToUint64ClampNullMax(info[1]);
+
+    if (min == 0 || max == SIZE_MAX || min > max)
+      throw RangeError::New(Env(), "Invalid adaptive bufsize range");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  adaptiveBufsizeMin = min;
+  adaptiveBufsizeMax = max;
+}
+
+size_t LZMAStream::nextOutputBufferSize() {
+  if (adaptiveBufsizeMax == 0)
+    return bufsize;
+
+  uint64_t in = 0, out = 0;
+  if (_.internal)
+    lzma_get_progress(&_, &in, &out);
+
+  uint64_t size = bufsize;
+  uint64_t pending = _.avail_in + inbufsLength;
+
+  // Estimate how much output the remaining input will produce, based on
+  // what we have seen so far. Before any data has been processed, we can
+  // only go with the configured default.
+  if (in > 0 && pending > 0) {
+    double expected = static_cast<double>(pending) * out / in;
+    size = expected > adaptiveBufsizeMax ? adaptiveBufsizeMax :
+        static_cast<uint64_t>(expected);
+  }
+
+  // Round up to a power of two, so that the output buffer pool only has to
+  // deal with a few different sizes.
+  uint64_t rounded = 1;
+  while (rounded < size && rounded < adaptiveBufsizeMax)
+    rounded <<= 1;
+
+  if (rounded < adaptiveBufsizeMin)
+    return adaptiveBufsizeMin;
+  if (rounded > adaptiveBufsizeMax)
+    return adaptiveBufsizeMax;
+  return static_cast<size_t>(rounded);
+}
+
+void LZMAStream::lockMutex(std::unique_lock<std::mutex>* lock) {
+  *lock = std::unique_lock<std::mutex>(mutex, std::try_to_lock);
+  if (lock->owns_lock())
+    return;
+
+  Clock::time_point start = Clock::now();
+  lock->lock();
+
+  uint64_t waited = nanosSince(start);
+  stats.mutexWaitNanos += waited;
+  aggregateStats().mutexWaitNanos += waited;
+}
+
 void LZMAStream::Code(const CallbackInfo& info) {
   MemScope mem_scope(this);
-  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_lock<std::mutex> lock;
+  lockMutex(&lock);
 
-  std::vector<uint8_t> inputData;
+  InputChunk chunk;
+  chunk.data = nullptr;
+  chunk.length = 0;
+  chunk.endsBatch = true;
 
   if (info[0].IsUndefined() || info[0].IsNull()) {
     shouldFinish = true;
+    inbufs.push(std::move(chunk));
+  } else if (info[0].IsArray()) {
+    Array buffers = info[0].As<Array>();
+    std::vector<InputChunk> batch;
+
+    // Check all elements before queueing any of them.
+    for (uint32_t i = 0; i < buffers.Length(); i++) {
+      Napi::Value buffer = buffers[i];
+      InputChunk part;
+      part.endsBatch = false;
+
+      readBufferPointerFromObj(buffer, &part.data, &part.length);
+
+      // Unlike a single empty Buffer, empty parts do not mean end of input.
+      if (part.length == 0)
+        continue;
+
+      part.buffer = Persistent(buffer.As<Object>());
+      batch.push_back(std::move(part));
+    }
+
+    // An empty chunk marks the end of the batch if there is no input at all.
+    if (batch.empty())
+      batch.push_back(std::move(chunk));
+    batch.back().endsBatch = true;
+
+    for (InputChunk& part : batch) {
+      inbufsLength += part.length;
+      inbufs.push(std::move(part));
+    }
   } else {
-    if (!readBufferFromObj(info[0], &inputData))
+    if (!readBufferPointerFromObj(info[0], &chunk.data, &chunk.length))
       return;
 
-    if (inputData.empty())
+    if (chunk.length == 0)
       shouldFinish = true;
+    else
+      chunk.buffer = Persistent(info[0].As<Object>());
+
+    inbufsLength += chunk.length;
+    inbufs.push(std::move(chunk));
   }
-  inbufs.push(std::move(inputData));
 
   bool async = info[1].ToBoolean();
 
   if (async) {
-    (new LZMAStreamCodingWorker(this))->Queue();
+    CodingThreadPool::Schedule(this, codingPriority);
   } else {
     doLZMACode();
     invokeBufferHandlers(true);
@@ -153,98 +501,236 @@ void LZMAStream::invokeBufferHandlers(bool hasLock) {
 
   std::unique_lock<std::mutex> lock;
   if (!hasLock)
-    lock = std::unique_lock<std::mutex>(mutex);
+    lockMutex(&lock);
 
-  Function bufferHandler = Napi::Value(Value()["bufferHandler"]).As<Function>();
-  std::vector<uint8_t> outbuf;
+  releaseConsumedInput();
 
-  auto CallBufferHandlerWithArgv = [&](size_t argc, const napi_value* argv) {
-    if (!hasLock) lock.unlock();
-    bufferHandler.MakeCallback(Value(), 5, argv, async_context);
-    if (!hasLock) lock.lock();
-  };
+  if (outbufs.empty() && lastCodeResult == LZMA_OK && processedChunks == 0)
+    return;
+
+  Tracer::Span span("bufferHandler", traceId);
+
+  Function bufferHandler = Napi::Value(Value()["bufferHandler"]).As<Function>();
 
   uint64_t in = UINT64_MAX, out = UINT64_MAX;
   if (_.internal)
     lzma_get_progress(&_, &in, &out);
-  Napi::Value in_   = Uint64ToNumberMaxNull(env, in);
-  Napi::Value out_  = Uint64ToNumberMaxNull(env, out);
 
-  while (outbufs.size() > 0) {
-    outbuf = std::move(outbufs.front());
+  // All pending output and status information is passed to JS in a single
+  // call: bufferHandler(buffers, ended, err, processedChunks, totalIn, totalOut)
+  Array buffers = Array::New(env, outbufs.size());
+  for (uint32_t i = 0; !outbufs.empty(); i++) {
+    buffers[i] = outputChunkToBuffer(outbufs.front());
     outbufs.pop();
-
-    napi_value argv[5] = {
-      Buffer<char>::Copy(env, reinterpret_cast<const char*>(outbuf.data()), outbuf.size()),
-      env.Undefined(), env.Undefined(), in_, out_
-    };
-    CallBufferHandlerWithArgv(5, argv);
   }
 
   bool reset = false;
+  Napi::Value errorArg = env.Null();
   if (lastCodeResult != LZMA_OK) {
-    Napi::Value errorArg = env.Null();
-
     if (lastCodeResult != LZMA_STREAM_END)
       errorArg = lzmaRetError(env, lastCodeResult).Value();
 
     reset = true;
-
-    napi_value argv[5] = { env.Null(), env.Undefined(), errorArg, in_, out_ };
-    CallBufferHandlerWithArgv(5, argv);
   }
 
-  if (processedChunks) {
-    size_t pc = processedChunks;
-    processedChunks = 0;
+  size_t pc = processedChunks;
+  processedChunks = 0;
 
-    napi_value argv[5] = {
-      env.Undefined(), Number::New(env, static_cast<uint32_t>(pc)),
-      env.Undefined(), in_, out_
-    };
-    CallBufferHandlerWithArgv(5, argv);
-  }
+  stats.callbacks++;
+  aggregateStats().callbacks++;
+
+  napi_value argv[6] = {
+    buffers,
+    Boolean::New(env, reset),
+    errorArg,
+    Number::New(env, static_cast<uint32_t>(pc)),
+    Uint64ToNumberMaxNull(env, in),
+    Uint64ToNumberMaxNull(env, out)
+  };
+
+  if (!hasLock) lock.unlock();
+  bufferHandler.MakeCallback(Value(), 6, argv, async_context);
+  if (!hasLock) lock.lock();
 
   if (reset)
     resetUnderlying(); // resets lastCodeResult!
 }
 
-void LZMAStream::doLZMACodeFromAsync() {
-  std::lock_guard<std::mutex> lock(mutex);
+void LZMAStream::releaseConsumedInput() {
+  consumedInbufs.clear();
+}
+
+Napi::Value LZMAStream::outputChunkToBuffer(const OutputChunk& chunk) {
+  Napi::Env env = Env();
+
+  size_t capacity = chunk.capacity;
+
+  // Mostly-empty chunks are copied so that JS does not hold on to a full
+  // bufsize worth of memory for a few bytes of output. External Buffers
+  // return their memory to the pool once they are garbage collected.
+  if (chunk.length >= capacity / 2) {
+    try {
+      return Buffer<uint8_t>::New(env, chunk.data, chunk.length,
+          [capacity](Napi::Env env, uint8_t* data) {
+            OutputBufferPool::Release(data, capacity);
+          });
+    } catch (const Error&) {
+      // Some environments (e.g. Electron) disallow external Buffers;
+      // fall back to copying.
+    }
+  }
 
-  doLZMACode();
+  Napi::Value buffer = Buffer<uint8_t>::Copy(env, chunk.data, chunk.length);
+  OutputBufferPool::Release(chunk.data, capacity);
+  return buffer;
 }
 
-void LZMAStream::doLZMACode() {
-  std::vector<uint8_t> outbuf(bufsize), inbuf;
-  _.next_out = outbuf.data();
-  _.avail_out = outbuf.size();
-  _.avail_in = 0;
+bool LZMAStream::doLZMACodeFromAsync(uint64_t quantumBytes, uint64_t quantumNanos,
+                                     uint64_t queuedNanos) {
+  std::unique_lock<std::mutex> lock;
+  lockMutex(&lock);
+
+  stats.queueNanos += queuedNanos;
+  aggregateStats().queueNanos += queuedNanos;
+
+  return doLZMACode(quantumBytes, quantumNanos);
+}
+
+bool LZMAStream::doLZMACode(uint64_t quantumBytes, uint64_t quantumNanos) {
+  Tracer::Span span("doLZMACode", traceId);
+
+  // With a quantum, liblzma is given input in slices of this size, so that
+  // a single call to lzma_code() cannot take much longer than the quantum.
+  const size_t kQuantumSlice = 32 * 1024;
+
+  bool limited = quantumBytes > 0 || quantumNanos > 0;
+  Clock::time_point deadline = Clock::now() + std::chrono::nanoseconds(quantumNanos);
+  uint64_t workDone = 0;
+  bool yielded = false;
+
+  // Added to the stream's and the process-wide counters at the end.
+  uint64_t codeNanos = 0, codeCalls = 0, bytesIn = 0, bytesOut = 0, outputChunks = 0;
+
+  OutputChunk outbuf = { nullptr, 0, 0 };
 
   lzma_action action = LZMA_RUN;
 
-  size_t readChunks = 0;
+  // A chunk that the previous step stopped in the middle of has been
+  // counted already, but not reported as processed.
+  size_t readChunks = partialChunk ? 1 : 0;
+  partialChunk = false;
 
   // _.internal is set to nullptr when lzma_end() is called via resetUnderlying()
   while (_.internal) {
     if (_.avail_in == 0) { // more input neccessary?
       while (_.avail_in == 0 && !inbufs.empty()) {
-        inbuf = std::move(inbufs.front());
+        InputChunk& inbuf = inbufs.front();
+        if (inbuf.endsBatch)
+          readChunks++;
+        currentInbufEndsBatch = inbuf.endsBatch;
+
+        _.next_in = inbuf.data;
+        _.avail_in = inbuf.length;
+        inbufsLength -= inbuf.length;
+
+        // The chunk’s memory stays alive until the next call to
+        // invokeBufferHandlers() after we are done with it.
+        if (!currentInbuf.IsEmpty())
+          consumedInbufs.push_back(std::move(currentInbuf));
+        currentInbuf = std::move(inbuf.buffer);
         inbufs.pop();
-        readChunks++;
+      }
+    }
+
+    if (betweenStreams) {
+      // Stream Padding consists of null bytes. Anything else is the start
+      // of the next stream.
+      while (_.avail_in > 0 && *_.next_in == 0) {
+        _.next_in++;
+        _.avail_in--;
+      }
 
-        _.next_in = inbuf.data();
-        _.avail_in = inbuf.size();
+      if (_.avail_in == 0) {
+        if (!inbufs.empty())
+          continue;
+
+        if (shouldFinish)
+          lastCodeResult = LZMA_STREAM_END;
+
+        processedChunks += readChunks;
+        readChunks = 0;
+
+        break;
+      }
+
+      betweenStreams = false;
+      lastCodeResult = restartDecoder();
+
+      if (lastCodeResult != LZMA_OK) {
+        processedChunks += readChunks;
+        readChunks = 0;
+
+        break;
       }
     }
 
-    if (shouldFinish && inbufs.empty())
+    size_t heldBack = 0;
+    if (limited && _.avail_in > kQuantumSlice) {
+      heldBack = _.avail_in - kQuantumSlice;
+      _.avail_in = kQuantumSlice;
+    }
+
+    // liblzma does not allow the input to grow once LZMA_FINISH was used.
+    if (shouldFinish && inbufs.empty() && heldBack == 0)
       action = LZMA_FINISH;
 
-    _.next_out = outbuf.data();
-    _.avail_out = outbuf.size();
+    // liblzma fails a second call in a row that cannot make progress,
+    // which a step that was queued again without new input would be.
+    if (stalled && _.avail_in == 0 && action == LZMA_RUN) {
+      processedChunks += readChunks;
+      readChunks = 0;
+
+      break;
+    }
+
+    if (outbuf.data == nullptr) {
+      // Output is written into uninitialized memory that is passed on
+      // to JS as-is once it is full or we run out of input.
+      outbuf.capacity = nextOutputBufferSize();
+      outbuf.data = OutputBufferPool::Acquire(outbuf.capacity);
+      outbuf.length = 0;
+
+      if (outbuf.data == nullptr) {
+        _.avail_in += heldBack;
+        lastCodeResult = LZMA_MEM_ERROR;
+        processedChunks += readChunks;
+        readChunks = 0;
+
+        break;
+      }
+
+      _.next_out = outbuf.data;
+      _.avail_out = outbuf.capacity;
+    }
+
+    size_t availInBefore = _.avail_in;
+    size_t availOutBefore = _.avail_out;
 
+    Clock::time_point codeStart = Clock::now();
     lastCodeResult = lzma_code(&_, action);
+    Clock::time_point codeEnd = Clock::now();
+    codeNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(codeEnd - codeStart).count();
+    codeCalls++;
+
+    if (Tracer::Enabled())
+      Tracer::Record("lzma_code", traceId, Tracer::Nanos(codeStart), Tracer::Nanos(codeEnd));
+
+    bytesIn += availInBefore - _.avail_in;
+    bytesOut += availOutBefore - _.avail_out;
+    workDone += (availInBefore - _.avail_in) + (availOutBefore - _.avail_out);
+    stalled = availInBefore == _.avail_in && availOutBefore == _.avail_out;
+    _.avail_in += heldBack;
+    outbuf.length = outbuf.capacity - _.avail_out;
 
     if (lastCodeResult != LZMA_OK && lastCodeResult != LZMA_STREAM_END) {
       processedChunks += readChunks;
@@ -253,43 +739,97 @@ void LZMAStream::doLZMACode() {
       break;
     }
 
-    if (_.avail_out == 0 || _.avail_in == 0 || lastCodeResult == LZMA_STREAM_END) {
-      size_t outsz = outbuf.size() - _.avail_out;
+    if (_.avail_out == 0) {
+      outbufs.push(outbuf);
+      outbuf.data = nullptr;
+      outputChunks++;
+    }
 
-      if (outsz > 0) {
-#ifndef LZMA_NO_CXX11_RVALUE_REFERENCES // C++11
-        outbufs.emplace(outbuf.data(), outbuf.data() + outsz);
-#else
-        outbufs.push(std::vector<uint8_t>(outbuf.data(), outbuf.data() + outsz));
-#endif
+    if (lastCodeResult == LZMA_STREAM_END) {
+      if (restartKind != RESTART_NONE) {
+        // Another stream may follow. Only report the end once all input
+        // has been seen.
+        betweenStreams = true;
+        lastCodeResult = LZMA_OK;
+        continue;
       }
 
-      if (lastCodeResult == LZMA_STREAM_END) {
-        processedChunks += readChunks;
-        readChunks = 0;
+      processedChunks += readChunks;
+      readChunks = 0;
 
-        break;
-      }
+      break;
     }
 
-    if (_.avail_out == outbuf.size()) { // no progress was made
+    // no progress was made and there is no more input
+    if (_.avail_out == availOutBefore && _.avail_in == 0 && inbufs.empty()) {
       if (!shouldFinish) {
         processedChunks += readChunks;
         readChunks = 0;
+
+        break;
       }
+    }
 
+    if ((quantumBytes > 0 && workDone >= quantumBytes) ||
+        (quantumNanos > 0 && Clock::now() >= deadline)) {
+      // Leave the rest for another step. A chunk that has not been read
+      // completely is not reported as processed yet, and neither is the
+      // end of input before the coder has finished.
+      partialChunk = readChunks > 0 &&
+          ((_.avail_in > 0 && currentInbufEndsBatch) || (shouldFinish && inbufs.empty()));
+      processedChunks += readChunks - (partialChunk ? 1 : 0);
+      readChunks = 0;
+      yielded = true;
 
-      if (!shouldFinish)
-        break;
+      break;
     }
   }
+
+  if (_.avail_in == 0 && !currentInbuf.IsEmpty())
+    consumedInbufs.push_back(std::move(currentInbuf));
+
+  if (outbuf.data != nullptr) {
+    if (outbuf.length > 0) {
+      outbufs.push(outbuf);
+      outputChunks++;
+    } else {
+      OutputBufferPool::Release(outbuf.data, outbuf.capacity);
+    }
+  }
+
+  stats.codeNanos += codeNanos;
+  stats.codeCalls += codeCalls;
+  stats.bytesIn += bytesIn;
+  stats.bytesOut += bytesOut;
+  stats.outputChunks += outputChunks;
+
+  AggregateStats& total = aggregateStats();
+  total.codeNanos += codeNanos;
+  total.codeCalls += codeCalls;
+  total.bytesIn += bytesIn;
+  total.bytesOut += bytesOut;
+  total.outputChunks += outputChunks;
+
+  return yielded;
+}
+
+lzma_ret LZMAStream::restartDecoder() {
+  // Re-initializing keeps the existing coder memory where possible.
+  if (restartKind == RESTART_AUTO_DECODER)
+    return lzma_auto_decoder(&_, restartMemlimit, restartFlags);
+  return lzma_stream_decoder(&_, restartMemlimit, restartFlags);
 }
 
 void LZMAStream::InitializeExports(Object exports) {
   exports["Stream"] = DefineClass(exports.Env(), "LZMAStream", {
     InstanceMethod("setBufsize", &LZMAStream::SetBufsize),
+    InstanceMethod("setAdaptiveBufsize", &LZMAStream::SetAdaptiveBufsize),
+    InstanceMethod("setCoderPoolKey", &LZMAStream::SetCoderPoolKey),
+    InstanceMethod("setHugePages", &LZMAStream::SetHugePages),
+    InstanceMethod("setPriority", &LZMAStream::SetPriority),
     InstanceMethod("resetUnderlying", &LZMAStream::ResetUnderlying),
     InstanceMethod("code", &LZMAStream::Code),
+    InstanceMethod("getStats", &LZMAStream::GetStats),
     InstanceMethod("memusage", &LZMAStream::Memusage),
     InstanceMethod("memlimitGet", &LZMAStream::MemlimitGet),
     InstanceMethod("memlimitSet", &LZMAStream::MemlimitSet),
@@ -306,6 +846,25 @@ void LZMAStream::InitializeExports(Object exports) {
   });
 }
 
+Value LZMAStream::GetStats(const CallbackInfo& info) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  return statsToObject(Env(), stats.codeNanos, stats.queueNanos, stats.mutexWaitNanos,
+                       stats.bytesIn, stats.bytesOut, stats.codeCalls, stats.callbacks,
+                       stats.outputChunks, allocatedBytes, stats.peakAllocatedBytes);
+}
+
+Value LZMAStream::GetAggregateStats(const CallbackInfo& info) {
+  AggregateStats& total = aggregateStats();
+
+  Object obj = statsToObject(info.Env(), total.codeNanos, total.queueNanos,
+                             total.mutexWaitNanos, total.bytesIn, total.bytesOut,
+                             total.codeCalls, total.callbacks, total.outputChunks,
+                             total.allocatedBytes, total.peakAllocatedBytes);
+  obj["streams"] = Number::New(info.Env(), static_cast<double>(total.streams));
+  return obj;
+}
+
 Value LZMAStream::Memusage(const CallbackInfo& info) {
   std::lock_guard<std::mutex> lock(mutex);
 
@@ -334,6 +893,7 @@ Value LZMAStream::RawEncoder(const CallbackInfo& info) {
 
   const FilterArray filters(info[0]);
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_raw_encoder(&_, filters.array()));
 }
 
@@ -342,6 +902,7 @@ Value LZMAStream::RawDecoder(const CallbackInfo& info) {
 
   const FilterArray filters(info[0]);
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_raw_decoder(&_, filters.array()));
 }
 
@@ -359,6 +920,7 @@ Value LZMAStream::EasyEncoder(const CallbackInfo& info) {
   int64_t preset = info[0].ToNumber().Int64Value();
   int64_t check = info[1].ToNumber().Int64Value();
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_easy_encoder(&_, preset, (lzma_check) check));
 }
 
@@ -368,6 +930,7 @@ Value LZMAStream::StreamEncoder(const CallbackInfo& info) {
   const FilterArray filters(info[0]);
   int64_t check = info[1].ToNumber().Int64Value();
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_stream_encoder(&_, filters.array(), (lzma_check) check));
 }
 
@@ -376,6 +939,10 @@ Value LZMAStream::MTEncoder(const CallbackInfo& info) {
 
   const MTOptions mt(info[0]);
 
+  // The encoder threads hold on to our allocator, so this coder cannot be
+  // handed over to other streams.
+  coderPoolKey.clear();
+
   return lzmaRet(Env(), lzma_stream_encoder_mt(&_, mt.opts()));
 }
 
@@ -384,6 +951,7 @@ Value LZMAStream::AloneEncoder(const CallbackInfo& info) {
 
   lzma_options_lzma o = parseOptionsLZMA(info[0]);
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_alone_encoder(&_, &o));
 }
 
@@ -393,6 +961,11 @@ Value LZMAStream::StreamDecoder(const CallbackInfo& info) {
   uint64_t memlimit = NumberToUint64ClampNullMax(info[0]);
   int64_t flags = info[1].ToNumber().Int64Value();
 
+  restartKind = RESTART_STREAM_DECODER;
+  restartMemlimit = memlimit;
+  restartFlags = static_cast<uint32_t>(flags);
+
+  takePooledCoder();
   return lzmaRet(Env(), lzma_stream_decoder(&_, memlimit, flags));
 }
 
@@ -402,6 +975,11 @@ Value LZMAStream::AutoDecoder(const CallbackInfo& info) {
   uint64_t memlimit = NumberToUint64ClampNullMax(info[0]);
   int64_t flags = info[1].ToNumber().Int64Value();
 
+  restartKind = RESTART_AUTO_DECODER;
+  restartMemlimit = memlimit;
+  restartFlags = static_cast<uint32_t>(flags);
+
+  takePooledCoder();
   return lzmaRet(Env(), lzma_auto_decoder(&_, memlimit, flags));
 }
 
@@ -410,6 +988,7 @@ Value LZMAStream::AloneDecoder(const CallbackInfo& info) {
 
   uint64_t memlimit = NumberToUint64ClampNullMax(info[0]);
 
+  takePooledCoder();
   return lzmaRet(Env(), lzma_alone_decoder(&_, memlimit));
 }
 
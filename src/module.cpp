@@ -5,6 +5,12 @@ using namespace lzma;
 static Napi::Object moduleInit(Env env, Object exports) {
   LZMAStream::InitializeExports(exports);
   IndexParser::InitializeExports(exports);
+  BlockCache::InitializeExports(exports);
+  BufferCoder::InitializeExports(exports);
+  BlockDecoder::InitializeExports(exports);
+  Hasher::InitializeExports(exports);
+  CRC::InitializeExports(exports);
+  Tracer::InitializeExports(exports);
 
   exports["versionNumber"] = Function::New(env, lzmaVersionNumber);
   exports["versionString"] = Function::New(env, lzmaVersionString);
@@ -15,10 +21,19 @@ static Napi::Object moduleInit(Env env, Object exports) {
   exports["filterDecoderIsSupported"] = Function::New(env, lzmaFilterDecoderIsSupported);
   exports["rawEncoderMemusage"] = Function::New(env, lzmaRawEncoderMemusage);
   exports["rawDecoderMemusage"] = Function::New(env, lzmaRawDecoderMemusage);
+  exports["mtEncoderMemusage_"] = Function::New(env, lzmaMTEncoderMemusage);
   exports["mfIsSupported"] = Function::New(env, lzmaMfIsSupported);
   exports["modeIsSupported"] = Function::New(env, lzmaModeIsSupported);
   exports["easyEncoderMemusage"] = Function::New(env, lzmaEasyEncoderMemusage);
   exports["easyDecoderMemusage"] = Function::New(env, lzmaEasyDecoderMemusage);
+  exports["outputBufferPoolStats"] = Function::New(env, OutputBufferPool::GetStats);
+  exports["setOutputBufferPoolLimit"] = Function::New(env, OutputBufferPool::SetLimit);
+  exports["coderPoolStats"] = Function::New(env, CoderPool::GetStats);
+  exports["setCoderPoolLimit"] = Function::New(env, CoderPool::SetLimit);
+  exports["codingThreadPoolStats"] = Function::New(env, CodingThreadPool::GetStats);
+  exports["setCodingThreads"] = Function::New(env, CodingThreadPool::SetThreads);
+  exports["setCodingQuantum"] = Function::New(env, CodingThreadPool::SetQuantum);
+  exports["streamStats"] = Function::New(env, LZMAStream::GetAggregateStats);
 
   // enum lzma_ret
   exports["OK"] = Number::New(env, LZMA_OK);
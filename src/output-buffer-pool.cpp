@@ -0,0 +1,125 @@
+#include "liblzma-node.hpp"
+#include <cstdlib>
+#include <map>
+
+namespace lzma {
+
+namespace {
+  struct PoolState {
+    PoolState() : retainedBytes(0), maxRetainedBytes(8 * 1024 * 1024), hits(0), misses(0) {}
+
+    std::mutex mutex;
+    // Free blocks, by size. Streams usually all use the same bufsize,
+    // so there will typically only be a single entry here.
+    std::map<size_t, std::vector<uint8_t*>> freeBlocks;
+    size_t retainedBytes;
+    size_t maxRetainedBytes;
+    uint64_t hits;
+    uint64_t misses;
+
+    // Free blocks until at most maxRetainedBytes are retained.
+    // The mutex needs to be held.
+    void trim() {
+      auto it = freeBlocks.begin();
+      while (retainedBytes > maxRetainedBytes && it != freeBlocks.end()) {
+        while (retainedBytes > maxRetainedBytes && !it->second.empty()) {
+          ::free(it->second.back());
+          it->second.pop_back();
+          retainedBytes -= it->first;
+        }
+
+        if (it->second.empty())
+          it = freeBlocks.erase(it);
+        else
+          ++it;
+      }
+    }
+  };
+
+  // Blocks may be released from Buffer finalizers that run during process
+  // teardown, so this is intentionally never destroyed.
+  PoolState& pool() {
+    static PoolState* state = new PoolState();
+    return *state;
+  }
+}
+
+uint8_t* OutputBufferPool::Acquire(size_t size) {
+  PoolState& p = pool();
+
+  {
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    auto it = p.freeBlocks.find(size);
+    if (it != p.freeBlocks.end() && !it->second.empty()) {
+      uint8_t* data = it->second.back();
+      it->second.pop_back();
+      p.retainedBytes -= size;
+      p.hits++;
+      return data;
+    }
+
+    p.misses++;
+  }
+
+  return static_cast<uint8_t*>(::malloc(size));
+}
+
+void OutputBufferPool::Release(uint8_t* data, size_t size) {
+  if (data == nullptr)
+    return;
+
+  PoolState& p = pool();
+
+  {
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    if (p.retainedBytes + size <= p.maxRetainedBytes) {
+      p.freeBlocks[size].push_back(data);
+      p.retainedBytes += size;
+      return;
+    }
+  }
+
+  ::free(data);
+}
+
+Napi::Value OutputBufferPool::GetStats(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  PoolState& p = pool();
+  std::lock_guard<std::mutex> lock(p.mutex);
+
+  size_t retainedBuffers = 0;
+  for (const auto& entry : p.freeBlocks)
+    retainedBuffers += entry.second.size();
+
+  Object obj = Object::New(env);
+  obj["hits"] = Number::New(env, static_cast<double>(p.hits));
+  obj["misses"] = Number::New(env, static_cast<double>(p.misses));
+  obj["retainedBuffers"] = Number::New(env, static_cast<double>(retainedBuffers));
+  obj["retainedBytes"] = Number::New(env, static_cast<double>(p.retainedBytes));
+  obj["maxRetainedBytes"] = Number::New(env, static_cast<double>(p.maxRetainedBytes));
+
+  return obj;
+}
+
+Napi::Value OutputBufferPool::SetLimit(const CallbackInfo& info) {
+  if (!info[0].IsNumber() || info[0].As<Number>().DoubleValue() < 0)
+    throw TypeError::New(info.Env(), "setOutputBufferPoolLimit() needs a non-negative numerical argument");
+
+  size_t newLimit = static_cast<size_t>(info[0].As<Number>().Int64Value());
+  size_t oldLimit;
+
+  PoolState& p = pool();
+  {
+    std::lock_guard<std::mutex> lock(p.mutex);
+
+    oldLimit = p.maxRetainedBytes;
+    p.maxRetainedBytes = newLimit;
+    p.trim();
+  }
+
+  return Number::New(info.Env(), static_cast<double>(oldLimit));
+}
+
+}
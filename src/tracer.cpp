@@ -0,0 +1,279 @@
+#include "liblzma-node.hpp"
+#include <uv.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace lzma {
+
+std::atomic<bool> Tracer::enabled(false);
+
+namespace {
+  const size_t kDefaultRingSize = 65536;
+
+  // Events are written by their thread only and may be read by Dump() at
+  // the same time, so they are guarded like a seqlock: seq is 0 while the
+  // event is being written and its index + 1 afterwards.
+  struct TraceEvent {
+    std::atomic<uint64_t> seq;
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> id;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+    std::atomic<bool> async;
+  };
+
+  struct Ring {
+    Ring(size_t capacity, uint64_t generation, uint32_t tid)
+      : events(new TraceEvent[capacity]),
+        capacity(capacity),
+        head(0),
+        generation(generation),
+        tid(tid),
+        retired(false) {
+      for (size_t i = 0; i < capacity; i++)
+        events[i].seq.store(0, std::memory_order_relaxed);
+    }
+
+    std::unique_ptr<TraceEvent[]> events;
+    size_t capacity;
+    std::atomic<uint64_t> head; // number of events written so far
+    uint64_t generation;
+    uint32_t tid;
+    std::string threadName;
+    // No longer written to, because the thread has moved on to a ring of a
+    // later session or has exited.
+    bool retired;
+  };
+
+  struct TraceState {
+    TraceState() : ringSize(kDefaultRingSize), startNanos(0), generation(0),
+                   nextTid(0), nextId(0) {}
+
+    std::mutex mutex;
+    // Rings of the current and earlier tracing sessions.
+    std::vector<std::unique_ptr<Ring>> rings;
+    size_t ringSize;
+    uint64_t startNanos;
+    std::atomic<uint64_t> generation;
+    uint32_t nextTid;
+    std::atomic<uint64_t> nextId;
+  };
+
+  TraceState& traceState() {
+    static TraceState* state = new TraceState();
+    return *state;
+  }
+
+  // Retires the ring of the thread when the thread exits, so that the next
+  // Start() can free it.
+  struct ThreadRing {
+    ThreadRing() : ring(nullptr) {}
+
+    ~ThreadRing() {
+      if (ring == nullptr)
+        return;
+
+      std::lock_guard<std::mutex> lock(traceState().mutex);
+      ring->retired = true;
+    }
+
+    Ring* ring;
+  };
+
+  thread_local ThreadRing threadRing;
+  thread_local uint32_t threadTid = 0;
+  thread_local const char* threadName = nullptr;
+
+  // Set up a ring for the calling thread in the current session.
+  Ring* currentRing() {
+    TraceState& t = traceState();
+    uint64_t generation = t.generation.load(std::memory_order_acquire);
+
+    if (threadRing.ring != nullptr && threadRing.ring->generation == generation)
+      return threadRing.ring;
+
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    if (threadTid == 0)
+      threadTid = ++t.nextTid;
+
+    Ring* ring = new Ring(t.ringSize, generation, threadTid);
+    if (threadName) {
+      ring->threadName = threadName;
+    } else {
+      char name[32];
+      snprintf(name, sizeof(name), "thread %u", threadTid);
+      ring->threadName = name;
+    }
+
+    if (threadRing.ring != nullptr)
+      threadRing.ring->retired = true;
+
+    t.rings.emplace_back(ring);
+    threadRing.ring = ring;
+    return ring;
+  }
+
+  void appendEvent(std::string* out, bool* first, const char* name, const char* ph,
+                   double ts, const char* extra) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s\n{\"name\":\"%s\",\"cat\":\"lzma\",\"ph\":\"%s\",\"ts\":%.3f,%s}",
+             *first ? "" : ",", name, ph, ts, extra);
+    out->append(buf);
+    *first = false;
+  }
+}
+
+uint64_t Tracer::NextId() {
+  return ++traceState().nextId;
+}
+
+void Tracer::SetThreadName(const char* name) {
+  threadName = name;
+
+  if (threadRing.ring != nullptr) {
+    std::lock_guard<std::mutex> lock(traceState().mutex);
+    threadRing.ring->threadName = name;
+  }
+}
+
+void Tracer::Record(const char* name, uint64_t id, uint64_t start, uint64_t end, bool async) {
+  Ring* ring = currentRing();
+
+  uint64_t index = ring->head.load(std::memory_order_relaxed);
+  TraceEvent& event = ring->events[index % ring->capacity];
+
+  event.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event.name.store(name, std::memory_order_relaxed);
+  event.id.store(id, std::memory_order_relaxed);
+  event.start.store(start, std::memory_order_relaxed);
+  event.end.store(end, std::memory_order_relaxed);
+  event.async.store(async, std::memory_order_relaxed);
+  event.seq.store(index + 1, std::memory_order_release);
+
+  ring->head.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::InitializeExports(Object exports) {
+  Napi::Env env = exports.Env();
+
+  SetThreadName("JS thread");
+
+  exports["startTracing"] = Function::New(env, Tracer::Start);
+  exports["stopTracing"] = Function::New(env, Tracer::Stop);
+  exports["dumpTrace"] = Function::New(env, Tracer::Dump);
+}
+
+Napi::Value Tracer::Start(const CallbackInfo& info) {
+  Napi::Env env = info.Env();
+  size_t ringSize = kDefaultRingSize;
+
+  if (!info[0].IsUndefined() && !info[0].IsNull()) {
+    Napi::Value events = info[0].As<Object>()["eventsPerThread"];
+
+    if (!events.IsUndefined()) {
+      if (!events.IsNumber() || events.As<Number>().DoubleValue() < 1)
+        throw TypeError::New(env, "eventsPerThread needs to be a positive number");
+      ringSize = static_cast<size_t>(events.As<Number>().DoubleValue());
+    }
+  }
+
+  TraceState& t = traceState();
+  std::lock_guard<std::mutex> lock(t.mutex);
+
+  // Rings that are still in use by their threads cannot be freed yet. Those
+  // of earlier sessions are retired when their threads record their next
+  // event or exit.
+  t.rings.erase(std::remove_if(t.rings.begin(), t.rings.end(),
+      [](const std::unique_ptr<Ring>& ring) { return ring->retired; }),
+      t.rings.end());
+
+  uint64_t generation = t.generation.load(std::memory_order_relaxed);
+
+  t.ringSize = ringSize;
+  t.startNanos = Now();
+  t.generation.store(generation + 1, std::memory_order_release);
+  enabled = true;
+
+  return env.Undefined();
+}
+
+Napi::Value Tracer::Stop(const CallbackInfo& info) {
+  enabled = false;
+  return info.Env().Undefined();
+}
+
+// Returns the events of the current (or last) session as a JSON string
+// that chrome://tracing and Perfetto can load.
+Napi::Value Tracer::Dump(const CallbackInfo& info) {
+  TraceState& t = traceState();
+  std::lock_guard<std::mutex> lock(t.mutex);
+
+  uint64_t generation = t.generation.load(std::memory_order_relaxed);
+  unsigned long pid = static_cast<unsigned long>(uv_os_getpid());
+  uint64_t dropped = 0;
+  bool first = true;
+  std::string out = "{\"traceEvents\":[";
+
+  for (const std::unique_ptr<Ring>& ring : t.rings) {
+    if (ring->generation != generation || generation == 0)
+      continue;
+
+    char extra[160];
+    snprintf(extra, sizeof(extra), "\"pid\":%lu,\"tid\":%u,\"args\":{\"name\":\"%s\"}",
+             pid, ring->tid, ring->threadName.c_str());
+    appendEvent(&out, &first, "thread_name", "M", 0, extra);
+
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t begin = head > ring->capacity ? head - ring->capacity : 0;
+    dropped += begin;
+
+    for (uint64_t i = begin; i < head; i++) {
+      const TraceEvent& event = ring->events[i % ring->capacity];
+
+      uint64_t seq = event.seq.load(std::memory_order_acquire);
+      const char* name = event.name.load(std::memory_order_relaxed);
+      uint64_t id = event.id.load(std::memory_order_relaxed);
+      uint64_t start = event.start.load(std::memory_order_relaxed);
+      uint64_t end = event.end.load(std::memory_order_relaxed);
+      bool async = event.async.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      // Overwritten while we were reading it.
+      if (seq != i + 1 || event.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      // Spans that began before tracing was started.
+      if (start < t.startNanos)
+        continue;
+
+      double ts = (start - t.startNanos) / 1e3;
+      double dur = (end - start) / 1e3;
+
+      if (async) {
+        snprintf(extra, sizeof(extra),
+                 "\"pid\":%lu,\"tid\":%u,\"id\":%llu,\"args\":{\"stream\":%llu}",
+                 pid, ring->tid, static_cast<unsigned long long>(id),
+                 static_cast<unsigned long long>(id));
+        appendEvent(&out, &first, name, "b", ts, extra);
+        appendEvent(&out, &first, name, "e", ts + dur, extra);
+      } else {
+        snprintf(extra, sizeof(extra),
+                 "\"dur\":%.3f,\"pid\":%lu,\"tid\":%u,\"args\":{\"stream\":%llu}",
+                 dur, pid, ring->tid, static_cast<unsigned long long>(id));
+        appendEvent(&out, &first, name, "X", ts, extra);
+      }
+    }
+  }
+
+  char tail[96];
+  snprintf(tail, sizeof(tail),
+           "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":%llu}}",
+           static_cast<unsigned long long>(dropped));
+  out.append(tail);
+
+  return String::New(info.Env(), out);
+}
+
+}
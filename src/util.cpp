@@ -1,5 +1,6 @@
 #include "liblzma-node.hpp"
 #include <cstring>
+#include <cstdlib>
 
 namespace lzma {
 
@@ -90,6 +91,21 @@ bool readBufferFromObj(Value buf_, std::vector<uint8_t>* data) {
   return true;
 }
 
+bool readBufferPointerFromObj(Value buf_, const uint8_t** data, size_t* length) {
+  if (!buf_.IsTypedArray()) {
+    throw TypeError::New(buf_.Env(), "Expected Buffer as input");
+    return false;
+  }
+
+  TypedArray buf = buf_.As<TypedArray>();
+  *length = buf.ByteLength();
+  *data = *length > 0 ?
+      static_cast<const uint8_t*>(buf.ArrayBuffer().Data()) + buf.ByteOffset() :
+      nullptr;
+
+  return true;
+}
+
 lzma_options_lzma parseOptionsLZMA (Value val) {
   HandleScope scope(val.Env());
   Object obj = val.IsUndefined() || val.IsNull() ?
@@ -128,6 +144,22 @@ Value Uint64ToNumber0Null(Env env, uint64_t in) {
     return Number::New(env, in);
 }
 
+Value MallocedBuffer(Env env, uint8_t* data, size_t length) {
+  try {
+    return Buffer<uint8_t>::New(env, data, length,
+        [](Env env, uint8_t* data) {
+          ::free(data);
+        });
+  } catch (const Error&) {
+    // Some environments (e.g. Electron) disallow external Buffers;
+    // fall back to copying.
+  }
+
+  Value buffer = Buffer<uint8_t>::Copy(env, data, length);
+  ::free(data);
+  return buffer;
+}
+
 uint64_t NumberToUint64ClampNullMax(Value in) {
   if (in.IsNull() || in.IsUndefined())
     return UINT64_MAX;
@@ -91,6 +91,21 @@ describe('LZMA.compress()/decompress()', function() {
     });
   });
   
+  it('reports progress', function(done) {
+    var LZMA = new lzma.LZMA();
+    var progress = [];
+    
+    LZMA.compress('Bananas', 5, function(result) {
+      assert.deepEqual(progress, [0, 1]);
+      LZMA.decompress(result, function(result) {
+        assert.equal(result.toString(), 'Bananas');
+        assert.deepEqual(progress, [0, 1, 0, 1]);
+        
+        done();
+      }, function(p) { progress.push(p); });
+    }, function(p) { progress.push(p); });
+  });
+  
   it('can round-trip, even for compressed data which uses LZMA2', function(done) {
     var LZMA = new lzma.LZMA();
     
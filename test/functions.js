@@ -1,6 +1,7 @@
 'use strict';
 
 var assert = require('assert');
+var crypto = require('crypto');
 var fs = require('fs');
 
 var lzma = require('../');
@@ -77,6 +78,130 @@ describe('lzma', function() {
     });
   });
 
+  describe('#createHash', function() {
+    var crypto = require('crypto');
+    var random = fs.readFileSync(__dirname + '/random-large');
+
+    it('should compute the standard check values', function() {
+      var crc32 = lzma.createHash(lzma.CHECK_CRC32).update('123456789').digest();
+      assert.strictEqual(crc32.readUInt32LE(0), 0xcbf43926);
+
+      assert.strictEqual(lzma.createHash(lzma.CHECK_CRC64).update('123456789').digest('hex'),
+        'fa3919dfbbc95d99');
+
+      assert.strictEqual(lzma.createHash(lzma.CHECK_SHA256).update('abc').digest('hex'),
+        'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad');
+    });
+
+    it('should allow incremental updates', function() {
+      [lzma.CHECK_CRC32, lzma.CHECK_CRC64, lzma.CHECK_SHA256].forEach(function(check) {
+        var whole = lzma.createHash(check).update(random).digest('hex');
+        var hash = lzma.createHash(check);
+
+        for (var i = 0; i < random.length; i += 1000 + i % 63)
+          hash.update(random.slice(i, i + 1000 + i % 63));
+
+        assert.strictEqual(hash.digest('hex'), whole);
+      });
+
+      assert.strictEqual(lzma.createHash(lzma.CHECK_CRC32).update(exampleSentence).digest().readUInt32LE(0),
+        lzma.crc32(exampleSentence));
+      assert.strictEqual(lzma.createHash(lzma.CHECK_SHA256).update(random).digest('hex'),
+        crypto.createHash('sha256').update(random).digest('hex'));
+    });
+
+    it('should hash Buffers asynchronously', function() {
+      var hash = lzma.createHash(lzma.CHECK_SHA256);
+      var promise = hash.updateAsync(random);
+
+      assert.throws(function() { hash.update('x'); }, /busy/);
+
+      return promise.then(function(result) {
+        assert.strictEqual(result, hash);
+        assert.strictEqual(hash.digest('hex'),
+          crypto.createHash('sha256').update(random).digest('hex'));
+      });
+    });
+
+    it('should hash file descriptors', function(done) {
+      var fd = fs.openSync(__dirname + '/random-large', 'r');
+      var hash = lzma.createHash(lzma.CHECK_CRC64);
+
+      hash.updateFD(fd, { start: 1000, length: 5000 }, function(err, bytes) {
+        assert.ifError(err);
+        assert.strictEqual(bytes, 5000);
+        assert.strictEqual(hash.digest('hex'),
+          lzma.createHash(lzma.CHECK_CRC64).update(random.slice(1000, 6000)).digest('hex'));
+
+        hash.updateFD(fd, { start: 6000 }, function(err, bytes) {
+          fs.closeSync(fd);
+          assert.ifError(err);
+          assert.strictEqual(bytes, random.length - 6000);
+          assert.strictEqual(hash.digest('hex'),
+            lzma.createHash(lzma.CHECK_CRC64).update(random.slice(1000)).digest('hex'));
+          done();
+        });
+      });
+    });
+
+    it('should report read errors', function() {
+      return lzma.createHash(lzma.CHECK_CRC32).updateFD(-1).then(function() {
+        assert.fail('should have failed');
+      }, function(err) {
+        assert.strictEqual(err.code, 'EBADF');
+      });
+    });
+
+    it('should reject unsupported checks', function() {
+      assert.throws(function() { lzma.createHash(lzma.CHECK_NONE); });
+    });
+  });
+
+  describe('#crcKernel', function() {
+    var best = lzma.crcKernel();
+
+    afterEach(function() {
+      lzma.setCRCKernel(best);
+    });
+
+    it('should return the name of the kernel in use', function() {
+      assert.ok(['clmul', 'pmull', 'table'].indexOf(best) !== -1);
+    });
+
+    it('should give the same results as the table-based kernel', function() {
+      var input = crypto.randomBytes(4096 + 64);
+
+      for (var length = 0; length <= 4096; length += (length < 300 ? 1 : 61)) {
+        [0, 3, 16].forEach(function(offset) {
+          var data = input.slice(offset, offset + length);
+          var results = [best, 'table'].map(function(kernel) {
+            lzma.setCRCKernel(kernel);
+            return [
+              lzma.crc32(data),
+              lzma.crc32(data, 0xdeadbeef),
+              lzma.createHash(lzma.CHECK_CRC64).update(data).digest('hex')
+            ];
+          });
+
+          assert.deepStrictEqual(results[0], results[1]);
+        });
+      }
+    });
+
+    it('should be possible to switch kernels', function() {
+      assert.strictEqual(lzma.setCRCKernel('table'), best);
+      assert.strictEqual(lzma.crcKernel(), 'table');
+      assert.strictEqual(lzma.crc32('crc32'), 0xafabd35e);
+    });
+
+    it('should fail for unknown kernels', function() {
+      assert.throws(function() {
+        lzma.setCRCKernel('abacus');
+      }, /CRC kernel 'abacus' is not available/);
+      assert.strictEqual(lzma.crcKernel(), best);
+    });
+  });
+
   describe('#filterEncoderIsSupported', function() {
     it('should return true for LZMA1, LZMA2', function() {
       assert.strictEqual(true, lzma.filterEncoderIsSupported(lzma.FILTER_LZMA1));
@@ -247,6 +372,193 @@ describe('lzma', function() {
     });
   });
 
+  describe('#outputBufferPoolStats', function() {
+    it('should report hits and misses', function() {
+      var stats = lzma.outputBufferPoolStats();
+      assert.strictEqual(typeof stats.hits, 'number');
+      assert.strictEqual(typeof stats.misses, 'number');
+      assert.strictEqual(typeof stats.retainedBytes, 'number');
+      assert.ok(stats.retainedBytes <= stats.maxRetainedBytes);
+    });
+
+    it('should recycle output buffers between coding steps', function(done) {
+      var input = fs.readFileSync('test/random');
+      var before = lzma.outputBufferPoolStats();
+
+      var enc = lzma.createCompressor({synchronous: true});
+      enc.resume();
+      enc.on('end', function() {
+        var after = lzma.outputBufferPoolStats();
+        assert.ok(after.hits > before.hits);
+        done();
+      });
+
+      for (var i = 0; i < input.length; i += 1024)
+        enc.write(input.slice(i, i + 1024));
+      enc.end();
+    });
+  });
+
+  describe('#setOutputBufferPoolLimit', function() {
+    it('should return the previous limit and trim the pool', function() {
+      var previous = lzma.setOutputBufferPoolLimit(0);
+      assert.strictEqual(typeof previous, 'number');
+      assert.strictEqual(lzma.outputBufferPoolStats().retainedBytes, 0);
+      assert.strictEqual(lzma.setOutputBufferPoolLimit(previous), 0);
+    });
+
+    it('should fail for invalid limits', function() {
+      assert.throws(function() { lzma.setOutputBufferPoolLimit(-1); });
+      assert.throws(function() { lzma.setOutputBufferPoolLimit('x'); });
+    });
+  });
+
+  describe('#coderPoolStats', function() {
+    it('should report hits and misses', function() {
+      var stats = lzma.coderPoolStats();
+      assert.strictEqual(typeof stats.hits, 'number');
+      assert.strictEqual(typeof stats.misses, 'number');
+      assert.strictEqual(typeof stats.retainedCoders, 'number');
+      assert.strictEqual(typeof stats.retainedBytes, 'number');
+    });
+  });
+
+  describe('#setCoderPoolLimit', function() {
+    it('should return the previous limit and release pooled coders', function() {
+      var previous = lzma.setCoderPoolLimit(0);
+      assert.strictEqual(typeof previous, 'number');
+      assert.strictEqual(lzma.coderPoolStats().retainedBytes, 0);
+      assert.strictEqual(lzma.setCoderPoolLimit(previous), 0);
+    });
+
+    it('should fail for invalid limits', function() {
+      assert.throws(function() { lzma.setCoderPoolLimit(-1); });
+      assert.throws(function() { lzma.setCoderPoolLimit('x'); });
+    });
+  });
+
+  describe('#blockCacheStats', function() {
+    it('should report cached blocks', function() {
+      var stats = lzma.blockCacheStats();
+      assert.strictEqual(typeof stats.hits, 'number');
+      assert.strictEqual(typeof stats.misses, 'number');
+      assert.strictEqual(typeof stats.retainedBlocks, 'number');
+      assert.ok(stats.retainedBytes <= stats.maxRetainedBytes);
+    });
+
+    it('should reuse memory of finished streams', function(done) {
+      lzma.compress('abc', { preset: 1 }, function(result, err) {
+        assert.ifError(err);
+        var before = lzma.blockCacheStats();
+
+        lzma.compress('abc', { preset: 1 }, function(result, err) {
+          assert.ifError(err);
+          assert.ok(lzma.blockCacheStats().hits > before.hits);
+          done();
+        });
+      });
+    });
+  });
+
+  describe('#setBlockCacheLimit', function() {
+    it('should return the previous limit and release cached blocks', function() {
+      var previous = lzma.setBlockCacheLimit(0);
+      assert.strictEqual(typeof previous, 'number');
+      assert.strictEqual(lzma.blockCacheStats().retainedBytes, 0);
+      assert.strictEqual(lzma.setBlockCacheLimit(previous), 0);
+    });
+
+    it('should fail for invalid limits', function() {
+      assert.throws(function() { lzma.setBlockCacheLimit(-1); });
+      assert.throws(function() { lzma.setBlockCacheLimit('x'); });
+    });
+  });
+
+  describe('#compressSync', function() {
+    it('should produce data that can be decompressed', function() {
+      var input = fs.readFileSync('test/random');
+      var compressed = lzma.compressSync(input, { preset: 3 });
+
+      assert.ok(lzma.isXZ(compressed));
+      assert.ok(lzma.decompressSync(compressed).equals(input));
+    });
+
+    it('should accept a preset number and strings', function() {
+      var compressed = lzma.compressSync('Bananas', 1);
+
+      assert.strictEqual(lzma.decompressSync(compressed).toString(), 'Bananas');
+    });
+
+    it('should fail for invalid options', function() {
+      assert.throws(function() { lzma.compressSync('Bananas', { preset: 12 }); });
+      assert.throws(function() { lzma.compressSync('Bananas', { check: 17 }); });
+    });
+  });
+
+  describe('#decompressSync', function() {
+    var hamlet = fs.readFileSync('test/hamlet.txt.xz');
+
+    it('should decode multi-stream files with padding', function() {
+      var expected = lzma.decompressSync(hamlet).toString();
+      var input = fs.readFileSync('test/hamlet.txt.2stream.xz');
+      var padded = Buffer.concat([input, Buffer.alloc(3), input]);
+
+      assert.strictEqual(lzma.decompressSync(input).toString(), expected);
+      assert.strictEqual(lzma.decompressSync(padded).toString(), expected + expected);
+    });
+
+    it('should decode .lzma files', function() {
+      var input = fs.readFileSync('test/hamlet.txt.lzma');
+
+      assert.ok(lzma.decompressSync(input).equals(lzma.decompressSync(hamlet)));
+    });
+
+    it('should fail for invalid or truncated input', function() {
+      assert.throws(function() { lzma.decompressSync('ABC'); }, /LZMA_/);
+      assert.throws(function() {
+        lzma.decompressSync(hamlet.slice(0, hamlet.length - 1));
+      }, /LZMA_/);
+      assert.throws(function() {
+        lzma.decompressSync(fs.readFileSync('test/invalid.xz'));
+      }, /LZMA_/);
+    });
+
+    it('should respect memlimit', function() {
+      assert.throws(function() {
+        lzma.decompressSync(hamlet, { memlimit: 1024 });
+      }, /LZMA_MEMLIMIT_ERROR/);
+    });
+
+    it('should decode output larger than memlimit', function() {
+      var input = Buffer.alloc(4 * 1024 * 1024);
+      var compressed = lzma.compressSync(input, { preset: 1 });
+
+      // The index claims more than memlimit, which does not limit the output.
+      assert.ok(lzma.decompressSync(compressed, { memlimit: 2 * 1024 * 1024 }).equals(input));
+    });
+  });
+
+  describe('#compress with oneShot', function() {
+    it('should round-trip through the asynchronous one-shot coders', function() {
+      var input = fs.readFileSync('test/random');
+
+      return lzma.compress(input, { oneShot: true }).then(function(compressed) {
+        assert.ok(lzma.isXZ(compressed));
+        return lzma.decompress(compressed);
+      }).then(function(result) {
+        assert.ok(result.equals(input));
+      });
+    });
+
+    it('should report errors to the callback', function(done) {
+      lzma.decompress(Buffer.from('ABC'), function(result, err) {
+        assert.strictEqual(result, null);
+        assert.ok(err);
+        done();
+      });
+    });
+  });
+
   /* meta stuff */
   describe('.version', function() {
     it('should be the same as the package.json version', function() {
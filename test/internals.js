@@ -1,6 +1,7 @@
 'use strict';
 
 var assert = require('assert');
+var fs = require('fs');
 
 var lzma = require('../');
 
@@ -12,6 +13,24 @@ describe('lzma-native internals', function() {
 			stream.nativeStream.bufferHandler = function() {};
 			assert.throws(function() { stream.nativeStream.code('I am not a Buffer object'); });
 		});
+
+		it('should pass all output of a coding step to a single bufferHandler call', function() {
+			var stream = lzma.createStream('easyEncoder', {synchronous: true, bufsize: 64});
+			var calls = [];
+
+			stream.nativeStream.bufferHandler = function(buffers, ended, err, processedChunks) {
+				calls.push({ buffers: buffers, ended: ended, err: err, processedChunks: processedChunks });
+			};
+
+			stream.nativeStream.code(fs.readFileSync('test/random'), false);
+			stream.nativeStream.code(null, false);
+
+			var last = calls[calls.length - 1];
+			assert.ok(last.buffers.length > 1);
+			assert.strictEqual(last.ended, true);
+			assert.strictEqual(last.err, null);
+			assert.strictEqual(last.processedChunks, 1);
+		});
 	});
 
 	describe('new/constructor', function() {
@@ -0,0 +1,264 @@
+'use strict';
+
+var assert = require('assert');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var bl = require('bl');
+
+var lzma = require('../');
+
+describe('lzma', function() {
+  if (typeof gc !== 'undefined') {
+    afterEach('garbage-collect', gc);
+  }
+
+  describe('#createParallelDecoder', function() {
+    var input, multiBlockXZ;
+
+    before('Compress into multiple blocks', function(done) {
+      input = fs.readFileSync('test/random-large');
+
+      var enc = lzma.createStream('easyEncoder', {
+        threads: 2,
+        blockSize: 64 * 1024,
+        preset: 1
+      });
+
+      enc.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        multiBlockXZ = buf.slice();
+        done();
+      }));
+
+      enc.end(input);
+    });
+
+    it('should decode multi-block files from Buffers', function(done) {
+      lzma.createParallelDecoder(multiBlockXZ, { threads: 3 }).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(input));
+        done();
+      }));
+    });
+
+    it('should decode multi-block files from file descriptors', function(done) {
+      var fd = fs.openSync('test/hamlet.txt.2stream.xz', 'r');
+      var hamlet = lzma.decompressSync(fs.readFileSync('test/hamlet.txt.xz'));
+
+      lzma.createParallelDecoder(fd).pipe(bl(function(err, buf) {
+        fs.closeSync(fd);
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(hamlet));
+        done();
+      }));
+    });
+
+    it('should decode one block at a time with a small in-flight limit', function(done) {
+      lzma.createParallelDecoder(multiBlockXZ, {
+        maxInFlightBytes: 1
+      }).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(input));
+        done();
+      }));
+    });
+
+    it('should fall back to a single decoder for single-block files', function(done) {
+      var xz = fs.readFileSync('test/hamlet.txt.xz');
+
+      lzma.createParallelDecoder(xz).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(lzma.decompressSync(xz)));
+        done();
+      }));
+    });
+
+    it('should fail for corrupt blocks', function(done) {
+      var corrupt = Buffer.from(multiBlockXZ);
+      corrupt[70000] ^= 0xff;
+
+      lzma.createParallelDecoder(corrupt).on('error', function(err) {
+        assert.strictEqual(err.code, lzma.DATA_ERROR);
+        done();
+      }).resume();
+    });
+
+    it('should decode blocks on the coding threads', function(done) {
+      var tasks = lzma.codingThreadPoolStats().tasks;
+
+      lzma.createParallelDecoder(multiBlockXZ, { threads: 8 }).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(input));
+        assert.ok(lzma.codingThreadPoolStats().tasks >= tasks + 2);
+        done();
+      }));
+    });
+
+    it('should not decode blocks larger than memlimit', function(done) {
+      var xz = lzma.compressSync(Buffer.alloc(4 * 1024 * 1024), { preset: 1 });
+      var blocks = Buffer.concat([xz, xz]);
+
+      // Enough for the preset 1 decoder, but not for a 4 MiB block.
+      lzma.createParallelDecoder(blocks, { memlimit: 2 * 1024 * 1024 }).on('error', function(err) {
+        assert.strictEqual(err.code, lzma.MEMLIMIT_ERROR);
+        done();
+      }).resume();
+    });
+
+    it('should fail for files without an index', function(done) {
+      lzma.createParallelDecoder(Buffer.from('not an .xz file at all')).on('error', function(err) {
+        assert.ok(err);
+        done();
+      }).resume();
+    });
+  });
+
+  describe('#openReader', function() {
+    var input, multiBlockXZ;
+
+    before('Compress into multiple blocks', function(done) {
+      input = fs.readFileSync('test/random-large');
+
+      var enc = lzma.createStream('easyEncoder', {
+        threads: 2,
+        blockSize: 64 * 1024,
+        preset: 1
+      });
+
+      enc.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        multiBlockXZ = buf.slice();
+        done();
+      }));
+
+      enc.end(input);
+    });
+
+    var checkReads = function(reader) {
+      assert.strictEqual(reader.size, input.length);
+      assert.strictEqual(reader.blocks, 4);
+
+      return Promise.all([
+        [0, 10],
+        [65530, 20],
+        [100000, 100000],
+        [input.length - 5, 100],
+        [input.length, 10],
+        [0, input.length]
+      ].map(function(range) {
+        return reader.read(range[0], range[1]).then(function(buf) {
+          assert.ok(buf.equals(input.slice(range[0], range[0] + range[1])));
+        });
+      }));
+    };
+
+    it('should read ranges from Buffers', function() {
+      return lzma.openReader(multiBlockXZ).then(checkReads);
+    });
+
+    it('should read ranges from file descriptors', function() {
+      var file = path.join(os.tmpdir(), 'lzma-native-random-large.xz');
+      fs.writeFileSync(file, multiBlockXZ);
+      var fd = fs.openSync(file, 'r');
+
+      return lzma.openReader(fd).then(checkReads).then(function() {
+        fs.closeSync(fd);
+        fs.unlinkSync(file);
+      });
+    });
+
+    it('should read ranges through read callbacks', function() {
+      var readCount = 0;
+
+      return lzma.openReader({
+        fileSize: multiBlockXZ.length,
+        read: function(count, offset, cb) {
+          readCount++;
+          setImmediate(function() {
+            cb(null, multiBlockXZ.slice(offset, offset + count));
+          });
+        }
+      }).then(function(reader) {
+        var before = readCount;
+
+        return reader.read(70000, 10).then(function(buf) {
+          assert.ok(buf.equals(input.slice(70000, 70010)));
+          // Only the block that contains the range is read.
+          assert.strictEqual(readCount, before + 1);
+        });
+      });
+    });
+
+    it('should provide streams for ranges', function(done) {
+      lzma.openReader(multiBlockXZ, function(err, reader) {
+        assert.ifError(err);
+
+        reader.createReadStream({ start: 60000, end: 199999 }).pipe(bl(function(err, buf) {
+          assert.ifError(err);
+          assert.ok(buf.slice().equals(input.slice(60000, 200000)));
+          done();
+        }));
+      });
+    });
+
+    it('should reject invalid sources and ranges', function() {
+      assert.throws(function() { lzma.openReader('foo'); }, TypeError);
+
+      return lzma.openReader(multiBlockXZ).then(function(reader) {
+        assert.throws(function() { reader.createReadStream({ start: -1 }); }, RangeError);
+      });
+    });
+  });
+
+  describe('#decompress with threads', function() {
+    var parts, concatenated;
+
+    before('Compress several single-block streams', function() {
+      var input = fs.readFileSync('test/random-large');
+      parts = [];
+
+      for (var i = 0; i < 5; i++)
+        parts.push(input.slice(i * 10000, i * 10000 + 30000));
+
+      // Like `cat a.xz b.xz ... > c.xz`, with some Stream Padding.
+      concatenated = Buffer.concat(parts.map(function(part) {
+        return Buffer.concat([lzma.compressSync(part), Buffer.alloc(4)]);
+      }));
+    });
+
+    it('should decode concatenated streams in order', function() {
+      return lzma.decompress(concatenated, { threads: 3 }).then(function(result) {
+        assert.ok(result.equals(Buffer.concat(parts)));
+      });
+    });
+
+    it('should decode concatenated streams with createParallelDecoder', function(done) {
+      lzma.createParallelDecoder(concatenated, { threads: 3 }).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(buf.slice().equals(Buffer.concat(parts)));
+        done();
+      }));
+    });
+
+    it('should fall back to regular decoding for .lzma files', function(done) {
+      var hamlet = fs.readFileSync('test/hamlet.txt.lzma');
+
+      lzma.decompress(hamlet, { threads: 2 }, function(result, err) {
+        assert.ifError(err);
+        assert.ok(result.equals(lzma.decompressSync(hamlet)));
+        done();
+      });
+    });
+
+    it('should report errors for invalid input', function(done) {
+      var invalid = Buffer.concat([concatenated, Buffer.from('garbage')]);
+
+      lzma.decompress(invalid, { threads: 2 }, function(result, err) {
+        assert.ok(err);
+        assert.strictEqual(result, null);
+        done();
+      });
+    });
+  });
+});
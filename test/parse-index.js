@@ -2,6 +2,8 @@
 
 var assert = require('assert');
 var fs = require('fs');
+var os = require('os');
+var path = require('path');
 
 var lzma = require('../');
 
@@ -171,6 +173,162 @@ describe('lzma', function() {
     });
   });
 
+  describe('#parseFileIndex with blockTable', function() {
+    var hamletXZ;
+    before('Read from a buffer into memory', function() {
+      hamletXZ = fs.readFileSync('test/hamlet.txt.2stream.xz');
+    });
+
+    var parse = function(blockTable) {
+      return lzma.parseFileIndex({
+        fileSize: hamletXZ.length,
+        blockTable: blockTable,
+        read: function(count, offset, cb) {
+          cb(hamletXZ.slice(offset, offset + count));
+        }
+      });
+    };
+
+    it('should provide the block table as typed arrays', function() {
+      var info = parse(true);
+      var table = info.blockTable;
+
+      checkInfo(info);
+      assert.strictEqual(table.count, 2);
+      assert.ok(table.uncompressedOffset instanceof Float64Array);
+      assert.deepStrictEqual(Array.from(table.stream), [1, 2]);
+      assert.deepStrictEqual(Array.from(table.check), [lzma.CHECK_CRC64, lzma.CHECK_CRC64]);
+      assert.strictEqual(table.uncompressedOffset[0], 0);
+      assert.strictEqual(table.uncompressedOffset[1], table.uncompressedSize[0]);
+      assert.strictEqual(table.uncompressedSize[0] + table.uncompressedSize[1],
+        info.uncompressedSize);
+      assert.ok(table.compressedOffset[1] > table.compressedOffset[0]);
+      assert.ok(table.unpaddedSize[0] <= table.compressedSize[0]);
+    });
+
+    it('should locate blocks by uncompressed offset', function() {
+      var table = parse(true).blockTable;
+      var boundary = table.uncompressedOffset[1];
+      var end = boundary + table.uncompressedSize[1];
+
+      assert.strictEqual(table.locate(0), 0);
+      assert.strictEqual(table.locate(boundary - 1), 0);
+      assert.strictEqual(table.locate(boundary), 1);
+      assert.strictEqual(table.locate(end - 1), 1);
+      assert.strictEqual(table.locate(end), -1);
+      assert.strictEqual(table.locate(-1), -1);
+    });
+
+    it('should support BigUint64Array columns', function() {
+      if (typeof BigUint64Array === 'undefined')
+        return this.skip();
+
+      var table = parse('bigint').blockTable;
+      var boundary = table.uncompressedOffset[1];
+
+      assert.ok(table.uncompressedOffset instanceof BigUint64Array);
+      assert.strictEqual(typeof boundary, 'bigint');
+      assert.strictEqual(table.locate(boundary), 1);
+      assert.strictEqual(table.locate(Number(boundary) - 1), 0);
+    });
+
+    it('should accept BigInt offsets for Float64Array columns', function() {
+      if (typeof BigInt === 'undefined')
+        return this.skip();
+
+      var table = parse(true).blockTable;
+      var boundary = table.uncompressedOffset[1];
+
+      assert.strictEqual(table.locate(BigInt(boundary)), 1);
+      assert.strictEqual(table.locate(BigInt(boundary - 1)), 0);
+    });
+
+    it('should not provide a block table by default', function() {
+      assert.strictEqual(parse().blockTable, undefined);
+    });
+  });
+
+  describe('#parseFileIndexFD with sidecar', function() {
+    var file = path.join(os.tmpdir(), 'lzma-native-sidecar-' + process.pid + '.xz');
+    var sidecar = file + '.idx';
+    var fd;
+
+    beforeEach('Create the file', function() {
+      fs.writeFileSync(file, fs.readFileSync('test/hamlet.txt.2stream.xz'));
+      try { fs.unlinkSync(sidecar); } catch (e) {}
+      fd = fs.openSync(file, 'r');
+    });
+
+    afterEach('Remove the files', function() {
+      fs.closeSync(fd);
+      fs.unlinkSync(file);
+      try { fs.unlinkSync(sidecar); } catch (e) {}
+    });
+
+    var parse = function(callback) {
+      lzma.parseFileIndexFD(fd, { sidecar: sidecar, blockTable: true }, callback);
+    };
+
+    it('should write a sidecar and use it later', function(done) {
+      parse(function(err, first) {
+        if (err) return done(err);
+
+        checkInfo(first);
+        assert.strictEqual(first.fromSidecar, false);
+        assert.ok(fs.existsSync(sidecar));
+
+        parse(function(err, second) {
+          if (err) return done(err);
+
+          checkInfo(second);
+          assert.strictEqual(second.fromSidecar, true);
+          assert.strictEqual(second.fileSize, first.fileSize);
+          assert.strictEqual(second.uncompressedSize, first.uncompressedSize);
+          assert.strictEqual(second.streamPadding, first.streamPadding);
+          assert.deepStrictEqual(Array.from(second.blockTable.compressedOffset),
+            Array.from(first.blockTable.compressedOffset));
+          assert.deepStrictEqual(Array.from(second.blockTable.uncompressedSize),
+            Array.from(first.blockTable.uncompressedSize));
+          done();
+        });
+      });
+    });
+
+    it('should not use a stale sidecar', function(done) {
+      parse(function(err) {
+        if (err) return done(err);
+
+        fs.utimesSync(file, new Date(2000, 1, 1), new Date(2000, 1, 1));
+
+        parse(function(err, info) {
+          if (err) return done(err);
+
+          checkInfo(info);
+          assert.strictEqual(info.fromSidecar, false);
+          done();
+        });
+      });
+    });
+
+    it('should not use a corrupt sidecar', function(done) {
+      parse(function(err) {
+        if (err) return done(err);
+
+        var contents = fs.readFileSync(sidecar);
+        contents[contents.length - 10] ^= 0xff;
+        fs.writeFileSync(sidecar, contents);
+
+        parse(function(err, info) {
+          if (err) return done(err);
+
+          checkInfo(info);
+          assert.strictEqual(info.fromSidecar, false);
+          done();
+        });
+      });
+    });
+  });
+
   describe('#parseFileIndexFD', function() {
     var fd;
     before('Open the file', function(done) {
@@ -200,5 +358,39 @@ describe('lzma', function() {
         done();
       });
     });
+
+    it('should accept options', function(done) {
+      lzma.parseFileIndexFD(fd, { blockTable: true }, function(err, info) {
+        if (err) return done(err);
+
+        checkInfo(info);
+        assert.strictEqual(info.blockTable.count, 2);
+        assert.strictEqual(info.blockTable.locate(0), 0);
+        done();
+      });
+    });
+
+    it('should respect the memory limit', function(done) {
+      lzma.parseFileIndexFD(fd, { memlimit: 1 }, function(err, info) {
+        assert.ok(err);
+        assert.strictEqual(err.name, 'LZMA_MEMLIMIT_ERROR');
+        assert.ok(!info);
+        done();
+      });
+    });
+
+    it('should fail for files that are not .xz files', function(done) {
+      fs.open('test/random', 'r', function(err, randomFd) {
+        if (err) return done(err);
+
+        lzma.parseFileIndexFD(randomFd, function(err, info) {
+          fs.closeSync(randomFd);
+
+          assert.ok(err);
+          assert.ok(!info);
+          done();
+        });
+      });
+    });
   });
 });
@@ -91,13 +91,13 @@ describe('LZMAStream', function() {
 
     it('should bark loudly when given non-decodable data in async mode', function(done) {
       var stream = lzma.createStream('autoDecoder');
-      var sawError = false;
 
-      stream.on('error', function() { sawError = true; });
-      stream.on('end', function() {
-        assert.ok(sawError);
+      // The stream fails instead of ending, and reports the error only once.
+      stream.on('error', function(err) {
+        assert.strictEqual(err.code, lzma.FORMAT_ERROR);
         done();
       });
+      stream.on('end', function() { assert.ok(false); });
       stream.on('data', function() {});
 
       fs.createReadStream('test/random').pipe(stream);
@@ -105,17 +105,27 @@ describe('LZMAStream', function() {
 
     it('should bark loudly when given non-decodable data in sync mode', function(done) {
       var stream = lzma.createStream('autoDecoder', {synchronous: true});
-      var sawError = false;
 
-      stream.on('error', function() { sawError = true; });
-      stream.on('end', function() {
-        assert.ok(sawError);
+      // The stream fails instead of ending, and reports the error only once.
+      stream.on('error', function(err) {
+        assert.strictEqual(err.code, lzma.FORMAT_ERROR);
         done();
       });
+      stream.on('end', function() { assert.ok(false); });
       stream.on('data', function() {});
 
       fs.createReadStream('test/random').pipe(stream);
     });
+
+    it('should fail write callbacks of chunks that could not be decoded', function(done) {
+      var stream = lzma.createStream('autoDecoder');
+
+      stream.on('error', function() {});
+      stream.write(fs.readFileSync('test/random'), function(err) {
+        assert.strictEqual(err.code, lzma.FORMAT_ERROR);
+        done();
+      });
+    });
   });
 
   describe('#aloneEncoder', function() {
@@ -214,6 +224,25 @@ describe('LZMAStream', function() {
       encodeAndDecode(enc, dec, done, bl(''));
     });
 
+    it('should read input from Buffer slices with an offset in async mode', function(done) {
+      var data = hamlet.slice();
+      var backing = Buffer.concat([Buffer.from('padding'), data, Buffer.from('padding')]);
+      var slice = backing.slice(7, 7 + data.length);
+
+      var enc = lzma.createStream('easyEncoder');
+      var dec = lzma.createStream('autoDecoder');
+
+      enc.pipe(dec).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(helpers.bufferEqual(data, buf));
+        done();
+      }));
+
+      for (var i = 0; i < slice.length; i += 4096)
+        enc.write(slice.slice(i, i + 4096));
+      enc.end();
+    });
+
     it('should be reasonably fast for one big chunk', function(done) {
       // “node createData.js | xz -9 > /dev/null” takes about 120ms for me.
       this.timeout(360); // three times as long as the above shell pipeline
@@ -428,6 +457,59 @@ describe('LZMAStream', function() {
     });
   });
 
+  describe('#code with several buffers', function() {
+    [false, true].forEach(function(synchronous) {
+      it('should handle corked writes (synchronous: ' + synchronous + ')', function(done) {
+        var input = largeRandom.slice();
+        var enc = lzma.createCompressor({ synchronous: synchronous });
+        var dec = lzma.createDecompressor({ synchronous: synchronous });
+        var acknowledged = 0;
+        var writes = 0;
+
+        enc.pipe(dec).pipe(bl(function(err, buf) {
+          assert.ifError(err);
+          assert.strictEqual(acknowledged, writes);
+          assert.ok(helpers.bufferEqual(buf, input));
+          done();
+        }));
+
+        enc.cork();
+        for (var i = 0; i < input.length; i += 10000) {
+          writes++;
+          enc.write(input.slice(i, i + 10000), function() { acknowledged++; });
+        }
+        enc.uncork();
+        enc.end();
+      });
+    });
+
+    it('should acknowledge batches without any input', function(done) {
+      var enc = lzma.createCompressor();
+      var acknowledged = 0;
+
+      enc.pipe(lzma.createDecompressor()).pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.strictEqual(acknowledged, 2);
+        assert.strictEqual(buf.toString(), 'Bananas');
+        done();
+      }));
+
+      enc.cork();
+      enc.write(Buffer.alloc(0), function() { acknowledged++; });
+      enc.write(Buffer.alloc(0), function() { acknowledged++; });
+      enc.uncork();
+      enc.end('Bananas');
+    });
+
+    it('should reject arrays with non-Buffer elements', function() {
+      var stream = lzma.createStream({ synchronous: true });
+
+      assert.throws(function() {
+        stream.code([Buffer.from('Bananas'), 'Bananas'], false);
+      }, /Expected Buffer as input/);
+    });
+  });
+
   describe('#memusage', function() {
     it('should return a meaningful value when decoding', function(done) {
       var stream = lzma.createStream('autoDecoder', {synchronous: true});
@@ -489,6 +571,72 @@ describe('LZMAStream', function() {
     });
   });
 
+  describe('#getStats', function() {
+    [false, true].forEach(function(synchronous) {
+      it('should count the work done by the stream (synchronous: ' + synchronous + ')', function(done) {
+        var input = largeRandom.slice();
+        var enc = lzma.createCompressor({ synchronous: synchronous, bufsize: 16384 });
+        var chunks = 0, length = 0;
+
+        enc.on('data', function(chunk) {
+          chunks++;
+          length += chunk.length;
+        });
+
+        enc.on('end', function() {
+          var stats = enc.getStats();
+          assert.strictEqual(stats.bytesIn, input.length);
+          assert.strictEqual(stats.bytesOut, length);
+          assert.strictEqual(stats.outputChunks, chunks);
+          assert.ok(stats.codeCalls >= chunks);
+          assert.ok(stats.callbacks > 0);
+          assert.ok(stats.codeMs > 0);
+          assert.ok(stats.peakAllocatedBytes > 0);
+          assert.strictEqual(stats.allocatedBytes, 0);
+          if (synchronous)
+            assert.strictEqual(stats.queueMs, 0);
+          done();
+        });
+
+        enc.end(input);
+      });
+    });
+
+    it('should not round allocations up much beyond the coder memory usage', function(done) {
+      var enc = lzma.createCompressor({ preset: 6 });
+
+      enc.on('data', function() {});
+      enc.on('end', function() {
+        // liblzma allocates its hash tables in sizes just above a power
+        // of two, which must not be rounded up to the next size class.
+        var memusage = lzma.easyEncoderMemusage(6);
+        assert.ok(enc.getStats().peakAllocatedBytes < memusage * 1.05);
+        done();
+      });
+
+      enc.end('Bananas');
+    });
+
+    it('should be summed up in lzma.streamStats()', function(done) {
+      var before = lzma.streamStats();
+      var enc = lzma.createCompressor();
+
+      enc.resume();
+      enc.on('end', function() {
+        var after = lzma.streamStats();
+        var stats = enc.getStats();
+        assert.strictEqual(after.bytesIn - before.bytesIn, stats.bytesIn);
+        assert.strictEqual(after.bytesOut - before.bytesOut, stats.bytesOut);
+        assert.strictEqual(after.outputChunks - before.outputChunks, stats.outputChunks);
+        assert.ok(after.peakAllocatedBytes >= stats.peakAllocatedBytes);
+        assert.ok(after.streams > 0);
+        done();
+      });
+
+      enc.end(largeRandom.slice());
+    });
+  });
+
   describe('bufsize', function() {
     it('Should only accept positive integers', function() {
       var stream = new lzma.createStream({synchronous: true});
@@ -524,6 +672,407 @@ describe('LZMAStream', function() {
       stream.bufsize = 8192;
       assert.strictEqual(stream.bufsize, 8192);
     });
+
+    it('Should not be changed by reading it', function() {
+      var stream = new lzma.createStream({synchronous: true, bufsize: 16384});
+
+      assert.strictEqual(stream.bufsize, 16384);
+      assert.strictEqual(stream.bufsize, 16384);
+    });
+
+    it('Should limit the size of output chunks', function(done) {
+      var stream = lzma.createDecompressor({bufsize: 4096});
+      var output = [];
+
+      stream.on('data', function(chunk) {
+        assert.ok(chunk.length <= 4096);
+        output.push(chunk);
+      });
+
+      stream.on('end', function() {
+        assert.ok(helpers.bufferEqual(Buffer.concat(output), hamlet));
+        done();
+      });
+
+      fs.createReadStream('test/hamlet.txt.xz').pipe(stream);
+    });
+
+    it('Should adapt to the compression ratio if adaptiveBufsize is set', function(done) {
+      var stream = lzma.createDecompressor({
+        bufsize: 4096,
+        adaptiveBufsize: true,
+        minBufsize: 1024,
+        maxBufsize: 65536
+      });
+      var output = [];
+
+      stream.on('data', function(chunk) {
+        assert.ok(chunk.length <= 65536);
+        output.push(chunk);
+      });
+
+      stream.on('end', function() {
+        assert.ok(output.some(function(chunk) { return chunk.length > 4096; }));
+        assert.ok(helpers.bufferEqual(Buffer.concat(output), hamlet));
+        done();
+      });
+
+      fs.createReadStream('test/hamlet.txt.xz').pipe(stream);
+    });
+
+    it('Should reject invalid adaptive bufsize ranges', function() {
+      var stream = lzma.createStream({synchronous: true});
+
+      assert.throws(function() {
+        stream.setAdaptiveBufsize(0, 4096);
+      }, /Invalid adaptive bufsize range/);
+
+      assert.throws(function() {
+        stream.setAdaptiveBufsize(8192, 4096);
+      }, /Invalid adaptive bufsize range/);
+    });
+  });
+
+  describe('coderPool', function() {
+    it('should reuse encoders from finished streams', function(done) {
+      var hitsBefore = lzma.coderPoolStats().hits;
+
+      lzma.compress('abc', { coderPool: true, preset: 1 }, function(abc, err) {
+        assert.ifError(err);
+        lzma.compress('def', { coderPool: true, preset: 1 }, function(def, err) {
+          assert.ifError(err);
+          assert.ok(lzma.coderPoolStats().hits > hitsBefore);
+
+          lzma.decompress(Buffer.concat([abc, def]), function(result, err) {
+            assert.ifError(err);
+            assert.strictEqual(result.toString(), 'abcdef');
+            done();
+          });
+        });
+      });
+    });
+
+    it('should not share encoders between streams with and without huge pages', function(done) {
+      lzma.compress('abc', { coderPool: true, preset: 2 }, function(abc, err) {
+        assert.ifError(err);
+        var hitsBefore = lzma.coderPoolStats().hits;
+
+        lzma.compress('def', { coderPool: true, preset: 2, hugePages: true }, function(def, err) {
+          assert.ifError(err);
+          assert.strictEqual(lzma.coderPoolStats().hits, hitsBefore);
+          done();
+        });
+      });
+    });
+
+    it('should reuse decoders for multi-stream files', function(done) {
+      var dec = lzma.createDecompressor({ coderPool: true });
+
+      dec.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(helpers.bufferEqual(buf, hamlet));
+        done();
+      }));
+
+      fs.createReadStream('test/hamlet.txt.2stream.xz').pipe(dec);
+    });
+  });
+
+  describe('coding thread pool', function() {
+    it('should run asynchronous coding steps', function(done) {
+      var tasksBefore = lzma.codingThreadPoolStats().tasks;
+
+      lzma.compress(random_data.slice(), function(result, err) {
+        assert.ifError(err);
+        assert.ok(lzma.codingThreadPoolStats().tasks > tasksBefore);
+        done();
+      });
+    });
+
+    it('should produce correct output for both priorities', function(done) {
+      var input = largeRandom.slice();
+      var remaining = 2;
+
+      ['latency', 'bulk'].forEach(function(priority) {
+        var enc = lzma.createCompressor({ priority: priority, preset: 1 });
+        var dec = lzma.createDecompressor({ priority: priority });
+
+        enc.pipe(dec).pipe(bl(function(err, buf) {
+          assert.ifError(err);
+          assert.ok(helpers.bufferEqual(buf, input));
+
+          if (--remaining === 0)
+            done();
+        }));
+
+        for (var i = 0; i < input.length; i += 8192)
+          enc.write(input.slice(i, i + 8192));
+        enc.end();
+      });
+    });
+
+    it('should reject unknown priorities', function() {
+      assert.throws(function() {
+        lzma.createCompressor({ priority: 'urgent' });
+      }, /Priority must be 'latency' or 'bulk'/);
+    });
+
+    it('should allow changing the number of threads', function(done) {
+      var previous = lzma.setCodingThreads(1);
+      assert.strictEqual(lzma.codingThreadPoolStats().threads, 1);
+
+      lzma.compress('Bananas', function(result, err) {
+        assert.ifError(err);
+        assert.strictEqual(lzma.setCodingThreads(previous), 1);
+
+        assert.throws(function() { lzma.setCodingThreads(0); }, TypeError);
+        done();
+      });
+    });
+
+    it('should split large writes into several coding steps', function(done) {
+      var previous = lzma.setCodingQuantum({ bytes: 16384, ms: 0 });
+      var yieldsBefore = lzma.codingThreadPoolStats().yields;
+      var input = largeRandom.slice();
+      var written = false;
+
+      var enc = lzma.createCompressor({ preset: 1 });
+      var dec = lzma.createDecompressor();
+
+      enc.pipe(dec).pipe(bl(function(err, buf) {
+        lzma.setCodingQuantum(previous);
+
+        assert.ifError(err);
+        assert.ok(written);
+        assert.ok(helpers.bufferEqual(buf, input));
+        assert.ok(lzma.codingThreadPoolStats().yields > yieldsBefore);
+        done();
+      }));
+
+      enc.end(input, function() { written = true; });
+    });
+
+    it('should not end streams that are still finishing', function(done) {
+      var previous = lzma.setCodingQuantum({ bytes: 16384, ms: 0 });
+      var input = largeRandom.slice();
+
+      var enc = lzma.createStream('easyEncoder', { threads: 2, blockSize: 64 * 1024, preset: 1 });
+
+      enc.pipe(lzma.createDecompressor()).pipe(bl(function(err, buf) {
+        lzma.setCodingQuantum(previous);
+
+        assert.ifError(err);
+        assert.ok(helpers.bufferEqual(buf, input));
+        done();
+      }));
+
+      enc.end(input);
+    });
+
+    it('should not limit coding steps by default', function() {
+      var stats = lzma.codingThreadPoolStats();
+      assert.strictEqual(stats.quantumMs, 0);
+      assert.strictEqual(stats.quantumBytes, 0);
+    });
+
+    it('should allow changing the work quantum', function() {
+      var previous = lzma.setCodingQuantum({ ms: 5 });
+      var stats = lzma.codingThreadPoolStats();
+      assert.strictEqual(stats.quantumMs, 5);
+      assert.strictEqual(stats.quantumBytes, previous.bytes);
+
+      assert.deepEqual(lzma.setCodingQuantum(previous), { bytes: previous.bytes, ms: 5 });
+
+      assert.throws(function() { lzma.setCodingQuantum({ ms: -1 }); }, TypeError);
+      assert.throws(function() { lzma.setCodingQuantum(10); }, TypeError);
+    });
+  });
+
+  describe('hugePages', function() {
+    it('should produce the same output as without huge pages', function(done) {
+      lzma.compress(hamlet.slice(), { preset: 8 }, function(plain, err) {
+        assert.ifError(err);
+        lzma.compress(hamlet.slice(), {
+          preset: 8,
+          hugePages: true,
+          hugePageThreshold: 1024 * 1024,
+          prefault: true
+        }, function(huge, err) {
+          assert.ifError(err);
+          assert.ok(helpers.bufferEqual(plain, huge));
+          done();
+        });
+      });
+    });
+
+    it('should reject invalid thresholds', function() {
+      var stream = lzma.createStream({synchronous: true});
+
+      assert.throws(function() {
+        stream.setHugePages(0);
+      }, /Invalid huge page threshold/);
+    });
+  });
+
+  describe('memory budget', function() {
+    var previousBudget;
+
+    beforeEach(function() {
+      previousBudget = lzma.setMemoryBudget(null);
+    });
+
+    afterEach(function() {
+      lzma.setMemoryBudget(previousBudget);
+    });
+
+    it('should queue streams that exceed the budget', function(done) {
+      var usage = lzma.memoryGovernorStats().usage;
+      lzma.setMemoryBudget(usage + lzma.easyEncoderMemusage(6) * 1.5);
+
+      var first = lzma.createCompressor({ preset: 6 });
+      var second = lzma.createCompressor({ preset: 6 });
+      assert.strictEqual(lzma.memoryGovernorStats().queueDepth, 1);
+
+      second.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.strictEqual(lzma.memoryGovernorStats().queueDepth, 0);
+
+        lzma.decompress(buf, function(result, err) {
+          assert.ifError(err);
+          assert.strictEqual(result.toString(), 'def');
+          done();
+        });
+      }));
+      second.end('def');
+
+      first.resume();
+      first.end('abc');
+    });
+
+    it('should downgrade presets if allowed', function(done) {
+      var usage = lzma.memoryGovernorStats().usage;
+      lzma.setMemoryBudget(usage + lzma.easyEncoderMemusage(6) * 1.5);
+
+      var first = lzma.createCompressor({ preset: 6 });
+      var second = lzma.createCompressor({ preset: 6, allowPresetDowngrade: true });
+      assert.strictEqual(lzma.memoryGovernorStats().queueDepth, 0);
+
+      first.resume();
+      first.end('abc');
+
+      second.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+
+        lzma.decompress(buf, function(result, err) {
+          assert.ifError(err);
+          assert.strictEqual(result.toString(), 'def');
+          done();
+        });
+      }));
+      second.end('def');
+    });
+
+    it('should not downgrade presets of streams that are queued anyway', function(done) {
+      var usage = lzma.memoryGovernorStats().usage;
+      // Enough for one stream at either preset, but not for two.
+      lzma.setMemoryBudget(usage + lzma.easyEncoderMemusage(4));
+
+      var first = lzma.createCompressor({ preset: 3 });
+      var second = lzma.createCompressor({ preset: 3 });
+      var third = lzma.createCompressor({ preset: 4, allowPresetDowngrade: true });
+      assert.strictEqual(lzma.memoryGovernorStats().queueDepth, 2);
+
+      var admit = third._admit;
+      third._admit = function() {
+        assert.strictEqual(this._memoryReservation, lzma.easyEncoderMemusage(4));
+        admit.call(this);
+      };
+
+      third.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+
+        lzma.decompress(buf, function(result, err) {
+          assert.ifError(err);
+          assert.strictEqual(result.toString(), 'ghi');
+          done();
+        });
+      }));
+      third.end('ghi');
+
+      second.resume();
+      second.end('def');
+      first.resume();
+      first.end('abc');
+    });
+
+    it('should reject invalid budgets', function() {
+      assert.throws(function() { lzma.setMemoryBudget(-1); });
+      assert.throws(function() { lzma.setMemoryBudget('x'); });
+    });
+  });
+
+  describe('tracing', function() {
+    afterEach(function() {
+      lzma.stopTracing();
+    });
+
+    function eventNames(trace) {
+      return trace.traceEvents.map(function(event) { return event.name; });
+    }
+
+    it('should record coding steps in trace-event format', function() {
+      lzma.startTracing();
+
+      return lzma.compress(largeRandom.slice()).then(function() {
+        lzma.stopTracing();
+
+        var trace = JSON.parse(lzma.dumpTrace());
+        var names = eventNames(trace);
+        assert.notStrictEqual(names.indexOf('thread_name'), -1);
+        assert.notStrictEqual(names.indexOf('queued'), -1);
+        assert.notStrictEqual(names.indexOf('bufferHandler'), -1);
+
+        var steps = trace.traceEvents.filter(function(event) {
+          return event.name === 'doLZMACode';
+        });
+        var calls = trace.traceEvents.filter(function(event) {
+          return event.name === 'lzma_code';
+        });
+
+        assert.ok(steps.length > 0);
+        assert.ok(calls.length >= steps.length);
+        steps.concat(calls).forEach(function(event) {
+          assert.strictEqual(event.ph, 'X');
+          assert.strictEqual(typeof event.args.stream, 'number');
+          assert.ok(event.ts >= 0 && event.dur >= 0);
+        });
+        assert.strictEqual(trace.otherData.droppedEvents, 0);
+      });
+    });
+
+    it('should not record anything while stopped', function() {
+      lzma.startTracing();
+      lzma.stopTracing();
+
+      return lzma.compress('Banana').then(function() {
+        assert.deepStrictEqual(eventNames(JSON.parse(lzma.dumpTrace())), []);
+      });
+    });
+
+    it('should keep only the latest events of each thread', function() {
+      lzma.startTracing({ eventsPerThread: 4 });
+
+      return lzma.compress(largeRandom.slice(), { synchronous: true, bufsize: 1024 }).then(function() {
+        var trace = JSON.parse(lzma.dumpTrace());
+        assert.ok(trace.otherData.droppedEvents > 0);
+      });
+    });
+
+    it('should fail for invalid buffer sizes', function() {
+      assert.throws(function() {
+        lzma.startTracing({ eventsPerThread: 0 });
+      }, /eventsPerThread needs to be a positive number/);
+    });
   });
 
   describe('multi-stream files', function() {
@@ -563,6 +1112,36 @@ describe('LZMAStream', function() {
       });
     });
 
+    it('can be decoded when split at arbitrary points', function(done) {
+      var input = fs.readFileSync('test/hamlet.txt.2stream.xz');
+      input = Buffer.concat([input, Buffer.alloc(3), input]);
+
+      var dec = lzma.createDecompressor({synchronous: true});
+
+      dec.pipe(bl(function(err, buf) {
+        assert.ifError(err);
+        assert.ok(helpers.bufferEqual(buf, Buffer.concat([hamlet.slice(), hamlet.slice()])));
+        done();
+      }));
+
+      for (var i = 0; i < input.length; i += 37)
+        dec.write(input.slice(i, i + 37));
+      dec.end();
+    });
+
+    it('fails for trailing garbage', function(done) {
+      lzma.compress('abc', { synchronous: true }, function(abc, err) {
+        assert.ifError(err);
+        lzma.decompress(Buffer.concat([abc, zeroes, Buffer.from('garbage')]), {
+          synchronous: true
+        }, function(result, err) {
+          assert.ok(err);
+          assert.strictEqual(err.name, 'LZMA_FORMAT_ERROR');
+          done();
+        });
+      });
+    });
+
     it('supports padding without multi-stream files', function(done) {
       lzma.compress('abc', { synchronous: true }, function(abc, err) {
         assert.ifError(err);